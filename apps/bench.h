@@ -0,0 +1,88 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+// Shared helpers for the bench_*.so modules. Each result is printed as one
+// JSON object per line so "make bench" can collect them.
+
+#define BENCH_STACK_SIZE    0x10000
+
+static inline long long BenchNow(void){
+    struct timespec Now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (long long)Now.tv_sec * 1000000000LL + Now.tv_nsec;
+}
+
+// Iteration count from the first module argument, or the default
+static inline int BenchIterations(int argc, char *argv[], int defaultcount){
+    int Count;
+    
+    if((1 < argc) && (0 < (Count = atoi(argv[1])))){
+        return Count;
+    }
+    return defaultcount;
+}
+
+// Forced switches: the priority scheduler never yields to an equal
+// priority thread, so a high priority partner and the caller take turns
+// blocking on two mutexes. Every round trip of BenchPingPong is four
+// context switches and four acquire/release pairs.
+static TVMMutexID BenchPingMutexes[2];
+
+static inline void BenchAcquire(TVMMutexID mutex){
+    while(VM_STATUS_SUCCESS != VMMutexAcquire(mutex, VM_TIMEOUT_INFINITE));
+}
+
+static inline void BenchPingPartner(void *param){
+    int Rounds = *(int *)param;
+    int Index;
+    
+    for(Index = 0; Index < Rounds; Index++){
+        BenchAcquire(BenchPingMutexes[0]);
+        VMMutexRelease(BenchPingMutexes[0]);
+        BenchAcquire(BenchPingMutexes[1]);
+        VMMutexRelease(BenchPingMutexes[1]);
+    }
+}
+
+// Returns the elapsed time for the given number of rounds
+static inline long long BenchPingPong(int rounds){
+    TVMThreadID PartnerID;
+    long long Start;
+    int Index;
+    
+    VMMutexCreate(&BenchPingMutexes[0]);
+    VMMutexCreate(&BenchPingMutexes[1]);
+    BenchAcquire(BenchPingMutexes[0]);
+    BenchAcquire(BenchPingMutexes[1]);
+    VMThreadCreate(BenchPingPartner, &rounds, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &PartnerID);
+    VMThreadActivate(PartnerID);
+    Start = BenchNow();
+    for(Index = 0; Index < rounds; Index++){
+        VMMutexRelease(BenchPingMutexes[0]);
+        BenchAcquire(BenchPingMutexes[0]);
+        VMMutexRelease(BenchPingMutexes[1]);
+        BenchAcquire(BenchPingMutexes[1]);
+    }
+    Start = BenchNow() - Start;
+    VMMutexRelease(BenchPingMutexes[0]);
+    VMMutexRelease(BenchPingMutexes[1]);
+    VMMutexDelete(BenchPingMutexes[0]);
+    VMMutexDelete(BenchPingMutexes[1]);
+    VMThreadDelete(PartnerID);
+    return Start;
+}
+
+static inline void BenchReport(const char *name, int iterations, long long elapsed){
+    VMPrint("{\"bench\": \"%s\", \"iterations\": %d, \"total_ns\": %lld, \"ns_per_op\": %.1f}\n", name, iterations, elapsed, (double)elapsed / iterations);
+}
+
+static inline void BenchReportThroughput(const char *name, int iterations, long long bytes, long long elapsed){
+    VMPrint("{\"bench\": \"%s\", \"iterations\": %d, \"bytes\": %lld, \"total_ns\": %lld, \"mb_per_s\": %.2f}\n", name, iterations, bytes, elapsed, elapsed ? (double)bytes * 1000.0 / elapsed : 0.0);
+}
+
+#endif
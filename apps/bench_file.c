@@ -0,0 +1,68 @@
+#include "bench.h"
+#include <fcntl.h>
+#include <string.h>
+
+#define BENCH_CHUNK_SIZE    512
+
+// Host reads come from stdin and host writes go to stderr, so run as
+// "vm bin/bench_file.so < /dev/zero 2> /dev/null". FAT transfers use
+// BENCH.DAT on the mounted image.
+void VMMain(int argc, char *argv[]){
+    int Iterations = BenchIterations(argc, argv, 2000);
+    int FATIterations = Iterations < 64 ? Iterations : 64;
+    char Buffer[BENCH_CHUNK_SIZE];
+    long long Start, Bytes;
+    int FileDescriptor, Length, Offset, Index;
+    
+    memset(Buffer, 'B', sizeof(Buffer));
+    Bytes = 0;
+    Start = BenchNow();
+    for(Index = 0; Index < Iterations; Index++){
+        Length = sizeof(Buffer);
+        if((VM_STATUS_SUCCESS != VMFileRead(0, Buffer, &Length)) || (0 >= Length)){
+            break;
+        }
+        Bytes += Length;
+    }
+    BenchReportThroughput("file_read_host", Index, Bytes, BenchNow() - Start);
+    
+    memset(Buffer, 'B', sizeof(Buffer));
+    Bytes = 0;
+    Start = BenchNow();
+    for(Index = 0; Index < Iterations; Index++){
+        Length = sizeof(Buffer);
+        if((VM_STATUS_SUCCESS != VMFileWrite(2, Buffer, &Length)) || (0 >= Length)){
+            break;
+        }
+        Bytes += Length;
+    }
+    BenchReportThroughput("file_write_host", Index, Bytes, BenchNow() - Start);
+    
+    if(VM_STATUS_SUCCESS != VMFileOpen("BENCH.DAT", O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptor)){
+        VMPrintError("Failed to open BENCH.DAT\n");
+        return;
+    }
+    Bytes = 0;
+    Start = BenchNow();
+    for(Index = 0; Index < FATIterations; Index++){
+        Length = sizeof(Buffer);
+        if((VM_STATUS_SUCCESS != VMFileWrite(FileDescriptor, Buffer, &Length)) || (0 >= Length)){
+            break;
+        }
+        Bytes += Length;
+    }
+    BenchReportThroughput("file_write_fat", Index, Bytes, BenchNow() - Start);
+    
+    VMFileSeek(FileDescriptor, 0, 0, &Offset);
+    Bytes = 0;
+    Start = BenchNow();
+    for(Index = 0; Index < FATIterations; Index++){
+        Length = sizeof(Buffer);
+        if((VM_STATUS_SUCCESS != VMFileRead(FileDescriptor, Buffer, &Length)) || (0 >= Length)){
+            break;
+        }
+        Bytes += Length;
+    }
+    BenchReportThroughput("file_read_fat", Index, Bytes, BenchNow() - Start);
+    VMFileClose(FileDescriptor);
+}
@@ -0,0 +1,22 @@
+#include "bench.h"
+
+void VMMain(int argc, char *argv[]){
+    int Iterations = BenchIterations(argc, argv, 100000);
+    TVMMutexID Mutex;
+    long long Start;
+    int Index;
+    
+    VMMutexCreate(&Mutex);
+    Start = BenchNow();
+    for(Index = 0; Index < Iterations; Index++){
+        VMMutexAcquire(Mutex, VM_TIMEOUT_INFINITE);
+        VMMutexRelease(Mutex);
+    }
+    BenchReport("mutex_uncontended", Iterations, BenchNow() - Start);
+    VMMutexDelete(Mutex);
+    
+    // Each handoff is a release waking the blocked owner-to-be and its
+    // acquire completing on the other side
+    Iterations /= 10;
+    BenchReport("mutex_contended", Iterations * 4, BenchPingPong(Iterations));
+}
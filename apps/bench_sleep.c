@@ -0,0 +1,26 @@
+#include "bench.h"
+
+// Reports how late VMThreadSleep wakes compared to the requested ticks
+void VMMain(int argc, char *argv[]){
+    int Iterations = BenchIterations(argc, argv, 100);
+    int TickMS, Index;
+    TVMTick Ticks;
+    long long Start, Late, TotalLate = 0, MaxLate = 0, MinLate = 0;
+    
+    VMTickMS(&TickMS);
+    for(Index = 0; Index < Iterations; Index++){
+        Ticks = 1 + (Index % 4);
+        Start = BenchNow();
+        VMThreadSleep(Ticks);
+        Late = BenchNow() - Start - (long long)Ticks * TickMS * 1000000LL;
+        TotalLate += Late;
+        // A sleep starting mid tick can wake early
+        if((0 == Index) || (Late > MaxLate)){
+            MaxLate = Late;
+        }
+        if((0 == Index) || (Late < MinLate)){
+            MinLate = Late;
+        }
+    }
+    VMPrint("{\"bench\": \"sleep_wake\", \"iterations\": %d, \"tick_ms\": %d, \"mean_late_ns\": %.1f, \"min_late_ns\": %lld, \"max_late_ns\": %lld}\n", Iterations, TickMS, (double)TotalLate / Iterations, MinLate, MaxLate);
+}
@@ -0,0 +1,34 @@
+#include "bench.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+void BenchEmpty(void *param){
+}
+
+void VMMain(int argc, char *argv[]){
+    int Iterations = BenchIterations(argc, argv, 2000);
+    TVMThreadID ThreadID;
+    long long CreateTime = 0, ActivateTime = 0, DeleteTime = 0, Start;
+    int Index;
+    
+    // A higher priority thread runs to completion inside VMThreadActivate
+    for(Index = 0; Index < Iterations; Index++){
+        Start = BenchNow();
+        VMThreadCreate(BenchEmpty, NULL, BENCH_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &ThreadID);
+        CreateTime += BenchNow() - Start;
+        Start = BenchNow();
+        VMThreadActivate(ThreadID);
+        ActivateTime += BenchNow() - Start;
+        Start = BenchNow();
+        VMThreadDelete(ThreadID);
+        DeleteTime += BenchNow() - Start;
+    }
+    BenchReport("thread_create", Iterations, CreateTime);
+    BenchReport("thread_activate_terminate", Iterations, ActivateTime);
+    BenchReport("thread_delete", Iterations, DeleteTime);
+    
+    Iterations *= 10;
+    BenchReport("context_switch", Iterations * 4, BenchPingPong(Iterations));
+}
@@ -0,0 +1,29 @@
+#include "VirtualMachine.h"
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define SPIN_LIMIT  2000000000
+
+volatile int Woke = 0;
+
+void VMThread(void *param){
+    VMThreadSleep(2);
+    Woke = 1;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID VMThreadID;
+    volatile unsigned int Iterations = 0;
+    VMPrint("VMMain creating thread.\n");
+    VMThreadCreate(VMThread, NULL, 0x100000, VM_THREAD_PRIORITY_HIGH, &VMThreadID);
+    VMThreadActivate(VMThreadID);
+    VMPrint("VMMain spinning\n");
+    // No VM calls in the loop, the thread can only wake if the tick preempts
+    while(!Woke && (Iterations < SPIN_LIMIT)){
+        Iterations++;
+    }
+    VMPrint("woke=%d after %u iters\n", Woke, Iterations);
+    VMPrint("Goodbye\n");
+}
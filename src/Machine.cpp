@@ -3,21 +3,31 @@
 #include <signal.h>
 #include <time.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+#include <sched.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <vector>
+#include <deque>
 #include <map>
+#include <algorithm>
 
 extern "C"{
 
@@ -32,236 +42,2240 @@ extern "C"{
 #define MACHINE_REQUEST_SEEK            5
 #define MACHINE_REQUEST_CLOSE           6
 #define MACHINE_REQUEST_TERMINATE       7
+#define MACHINE_REQUEST_BATCH           8
+#define MACHINE_REQUEST_PREAD           9
+#define MACHINE_REQUEST_PWRITE          10
+#define MACHINE_REQUEST_SYNC            11
+#define MACHINE_REQUEST_DATASYNC        12
+// Withdraws the request whose ID the header carries, it has no reply
+#define MACHINE_REQUEST_CANCEL          13
+#define MACHINE_REQUEST_TYPE_COUNT      14
+
+// Latency is kept for each request type from submit to child pickup,
+// pickup to the reply being posted, reply to callback, and overall. Bucket
+// N counts latencies of 2^N to 2^(N+1)-1 nanoseconds.
+#define MACHINE_LATENCY_QUEUE           0
+#define MACHINE_LATENCY_SERVICE         1
+#define MACHINE_LATENCY_REPLY           2
+#define MACHINE_LATENCY_TOTAL           3
+#define MACHINE_LATENCY_STAGE_COUNT     4
+#define MACHINE_LATENCY_BUCKETS         40
 
-#define MACHINE_MAX_MESSAGE_SIZE        0x10000
 #define MACHINE_PAGE_SIZE               4096
-#define MACHINE_MAX_TRANSFER_SIZE       512
+#define MACHINE_HUGE_PAGE_SIZE          (2 * 1024 * 1024)
+#define MACHINE_CACHE_LINE_SIZE         64
+
+#define MACHINE_REQUEST_RING_COUNT      64
+#define MACHINE_REPLY_RING_COUNT        256
+#define MACHINE_MAX_BATCH_GROUPS        64
+#define MACHINE_MAX_BATCH_REQUEST_ENTRIES   32
+// The child reads this much ahead once a descriptor has been read
+// sequentially MACHINE_READAHEAD_TRIGGER times in a row
+#define MACHINE_READAHEAD_SIZE          65536
+#define MACHINE_READAHEAD_TRIGGER       2
+// Console output is buffered per descriptor on its way to stdout and
+// stderr. The child writes it out a line at a time, all of it once the
+// ring is half full, and a partial line once it has waited this long.
+#define MACHINE_CONSOLE_RING_SIZE       8192
+#define MACHINE_CONSOLE_COUNT           2
+#define MACHINE_CONSOLE_DEADLINE_MS     2
+// How often the child probes for its parent when it has no pidfd
+#define MACHINE_PARENT_PROBE_MS         1
+
+// Request IDs carry the callback slot index in the low bits and the
+// slot's generation above it, so a stale or duplicate reply is ignored
+#define MACHINE_PENDING_INDEX_BITS      10
+#define MACHINE_MAX_PENDING_CALLBACKS   (1 << MACHINE_PENDING_INDEX_BITS)
+#define MACHINE_PENDING_INDEX_MASK      (MACHINE_MAX_PENDING_CALLBACKS - 1)
 
 typedef struct{
-    pid_t DParentPID;
-    pid_t DChildPID;
-    int DRequestChannel;
-    int DReplyChannel;
-    int DMMapFile;
-    uint8_t *DSharedBase;
-    size_t DSharedSize;
-} SMachineData, *SMachineDataRef;
+    TMachineFileCallback DCallback;
+    void *DCalldata;
+    int DRemaining;
+    int DFailed;
+} SMachineBatchGroup, *SMachineBatchGroupRef;
 
 typedef struct{
     TMachineFileCallback DCallback;
     void *DCalldata;
+    SMachineBatchEntryRef DBatchEntry;
+    SMachineBatchGroupRef DBatchGroup;
+    uint32_t DRequestID;
+    uint32_t DGeneration;
+    bool DInUse;
+    uint32_t DType;
+    uint64_t DSubmitTime;
 } SMachinePendingCallback, *SMachinePendingCallbackRef;
 
 typedef struct{
-    long DType;
+    uint64_t DCount;
+    uint64_t DTotal;
+    uint64_t DMaximum;
+    uint64_t DBuckets[MACHINE_LATENCY_BUCKETS];
+} SMachineLatencyHistogram, *SMachineLatencyHistogramRef;
+
+typedef struct{
+    uint32_t DType;
     uint32_t DRequestID;
-    uint8_t DPayload[1];
+} SMachineRequestHeader, *SMachineRequestHeaderRef;
+
+typedef struct{
+    SMachineRequestHeader DHeader;
+    int DFlags;
+    int DMode;
+    char DFileName[PATH_MAX];
+} SMachineOpenRequest, *SMachineOpenRequestRef;
+
+// A buffer named by the shared region it lies in and its offset there, so
+// it means the same thing to any process that maps the region wherever
+typedef struct{
+    uint32_t DRegion;
+    uint32_t DOffset;
+    int DLength;
+} SMachineShareReference, *SMachineShareReferenceRef;
+
+// Used for all reads and writes, only the first DCount segments are sent.
+// DOffset is only used by the positional requests.
+typedef struct{
+    SMachineRequestHeader DHeader;
+    int DFileDescriptor;
+    int DCount;
+    int DOffset;
+    int DReserved;
+    SMachineShareReference DSegments[MACHINE_MAX_FILE_SEGMENTS];
+} SMachineTransferRequest, *SMachineTransferRequestRef;
+
+typedef struct{
+    SMachineRequestHeader DHeader;
+    int DFileDescriptor;
+    int DOffset;
+    int DWhence;
+} SMachineSeekRequest, *SMachineSeekRequestRef;
+
+typedef struct{
+    SMachineRequestHeader DHeader;
+    int DFileDescriptor;
+} SMachineCloseRequest, *SMachineCloseRequestRef;
+
+typedef struct{
+    SMachineRequestHeader DHeader;
+    int DFileDescriptor;
+} SMachineSyncRequest, *SMachineSyncRequestRef;
+
+// DArgument1 and DArgument2 are the flags and mode of an open or the
+// offset and whence of a seek, DArgument1 is the offset of a positional
+// read or write. An open's name is at DNameOffset in DNames.
+typedef struct{
+    int DOperation;
+    uint32_t DRequestID;
+    int DFileDescriptor;
+    int DArgument1;
+    int DArgument2;
+    int DNameOffset;
+    SMachineShareReference DData;
+} SMachineBatchRequestEntry, *SMachineBatchRequestEntryRef;
+
+// Only the used part of DNames is sent
+typedef struct{
+    SMachineRequestHeader DHeader;
+    int DCount;
+    int DNamesLength;
+    SMachineBatchRequestEntry DEntries[MACHINE_MAX_BATCH_REQUEST_ENTRIES];
+    char DNames[PATH_MAX];
+} SMachineBatchRequest, *SMachineBatchRequestRef;
+
+typedef union{
+    SMachineRequestHeader DHeader;
+    SMachineOpenRequest DOpen;
+    SMachineTransferRequest DTransfer;
+    SMachineSeekRequest DSeek;
+    SMachineCloseRequest DClose;
+    SMachineSyncRequest DSync;
+    SMachineBatchRequest DBatch;
 } SMachineRequest, *SMachineRequestRef;
 
+// The layouts are shared with the child as raw bytes, so make sure no
+// padding crept in and every slot starts on its own cache line
+static_assert(sizeof(SMachineRequestHeader) == 2 * sizeof(uint32_t), "SMachineRequestHeader is padded");
+static_assert(sizeof(SMachineOpenRequest) == sizeof(SMachineRequestHeader) + 2 * sizeof(int) + PATH_MAX, "SMachineOpenRequest is padded");
+static_assert(sizeof(SMachineSeekRequest) == sizeof(SMachineRequestHeader) + 3 * sizeof(int), "SMachineSeekRequest is padded");
+static_assert(sizeof(SMachineCloseRequest) == sizeof(SMachineRequestHeader) + sizeof(int), "SMachineCloseRequest is padded");
+static_assert(sizeof(SMachineSyncRequest) == sizeof(SMachineRequestHeader) + sizeof(int), "SMachineSyncRequest is padded");
+static_assert(sizeof(SMachineShareReference) == 2 * sizeof(uint32_t) + sizeof(int), "SMachineShareReference is padded");
+static_assert(offsetof(SMachineTransferRequest, DSegments) == sizeof(SMachineRequestHeader) + 4 * sizeof(int), "SMachineTransferRequest is padded");
+static_assert(sizeof(SMachineBatchRequestEntry) == 6 * sizeof(int) + sizeof(SMachineShareReference), "SMachineBatchRequestEntry is padded");
+static_assert(offsetof(SMachineBatchRequest, DEntries) == sizeof(SMachineRequestHeader) + 2 * sizeof(int), "SMachineBatchRequest is padded");
+
+typedef struct{
+    uint32_t DLength;
+    SMachineRequest DMessage;
+} __attribute__((aligned(MACHINE_CACHE_LINE_SIZE))) SMachineRequestSlot, *SMachineRequestSlotRef;
+
+static_assert(0 == sizeof(SMachineRequestSlot) % MACHINE_CACHE_LINE_SIZE, "SMachineRequestSlot is not a whole number of cache lines");
+
+// The child stamps when it picked the request up and when it replied
+typedef struct{
+    uint32_t DRequestID;
+    int DResult;
+    uint64_t DPickupTime;
+    uint64_t DCompleteTime;
+} SMachineReplySlot, *SMachineReplySlotRef;
+
+static_assert(sizeof(SMachineReplySlot) == 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t), "SMachineReplySlot is padded");
+
+typedef struct{
+    volatile uint32_t DHead __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    volatile uint32_t DTail __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    uint8_t DData[MACHINE_CONSOLE_RING_SIZE] __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+} SMachineConsoleRing, *SMachineConsoleRingRef;
+
+// Single-producer/single-consumer rings that live past the end of the
+// shared region. The parent produces requests and consumes replies, the
+// child does the opposite. Each side only rings the doorbell (eventfd for
+// the child, SIGUSR2 for the parent) when the other side has said it needs
+// one, so a busy stream of requests costs no syscalls beyond the I/O itself.
+typedef struct{
+    volatile uint32_t DRequestHead __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    volatile uint32_t DRequestTail __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    volatile uint32_t DRequestSleeping __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    volatile uint32_t DReplyHead __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    volatile uint32_t DReplyTail __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    volatile uint32_t DReplySignaled __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    SMachineRequestSlot DRequests[MACHINE_REQUEST_RING_COUNT] __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    SMachineReplySlot DReplies[MACHINE_REPLY_RING_COUNT] __attribute__((aligned(MACHINE_CACHE_LINE_SIZE)));
+    SMachineConsoleRing DConsoles[MACHINE_CONSOLE_COUNT];
+} SMachineRings, *SMachineRingsRef;
+
+typedef struct{
+    pid_t DParentPID;
+    pid_t DChildPID;
+    int DRequestDoorbell;
+    int DMMapFile;
+    uint8_t *DSharedBase;
+    size_t DSharedSize;
+    size_t DMappedSize;
+    SMachineRingsRef DRings;
+} SMachineData, *SMachineDataRef;
+
 typedef struct{
     uint32_t DRequestID;
     int DFileDescriptor;
-    int DLength;
-    uint8_t *DBuffer;
+    int DCount;
+    struct iovec DSegments[MACHINE_MAX_FILE_SEGMENTS];
 } SMachinePendingRead, *SMachinePendingReadRef;
 
+// Child side read buffer of a descriptor. For a regular file it holds the
+// bytes at DOffset onward, read ahead of a sequential positional reader.
+// For a stream such as a console pipe it holds what a read returned
+// beyond what was asked for, starting at DStart.
+typedef struct{
+    bool DStream;
+    dev_t DDevice;
+    ino_t DInode;
+    off_t DOffset;
+    off_t DNextOffset;
+    int DSequential;
+    int DStart;
+    int DLength;
+    uint8_t DData[MACHINE_READAHEAD_SIZE];
+} SMachineReadAhead, *SMachineReadAheadRef;
+
+// A single file operation decoded from a request or batch; DOperation is
+// one of the MACHINE_BATCH_ kinds
+typedef struct{
+    uint32_t DRequestID;
+    int DOperation;
+    int DFileDescriptor;
+    int DArgument1;
+    int DArgument2;
+    int DCount;
+    struct iovec DSegments[MACHINE_MAX_FILE_SEGMENTS];
+    char *DFileName;
+} SMachineOperation, *SMachineOperationRef;
+
+// What a worker holds of a queue, the first DCount entries, and the
+// eventfd that interrupts a read it is waiting on
+typedef struct{
+    size_t DCount;
+    int DCancelFD;
+} SMachineWorkRunning, *SMachineWorkRunningRef;
+
+typedef struct{
+    pthread_mutex_t DMutex;
+    pthread_cond_t DCondition;
+    std::map< int64_t, std::deque< SMachineOperationRef > > DQueues;
+    std::map< int64_t, SMachineWorkRunning > DRunning;
+    std::deque< int64_t > DReady;
+    bool DTerminated;
+} SMachineWorkQueue, *SMachineWorkQueueRef;
+
+#ifdef __linux__
+#define MACHINE_URING_ENTRIES           128
+#define MACHINE_URING_DOORBELL          ((uint64_t)1)
+#define MACHINE_URING_TIMEOUT           ((uint64_t)2)
+#define MACHINE_URING_PARENT            ((uint64_t)3)
+#define MACHINE_URING_CANCEL            ((uint64_t)4)
+#define MACHINE_URING_CONSOLE           ((uint64_t)5)
+
+typedef struct{
+    int DFileDescriptor;
+    uint8_t *DRingBase;
+    size_t DRingSize;
+    size_t DEntriesSize;
+    uint32_t *DSubmitHead;
+    uint32_t *DSubmitTail;
+    uint32_t *DSubmitArray;
+    uint32_t DSubmitMask;
+    uint32_t DSubmitCount;
+    uint32_t DPendingSubmit;
+    struct io_uring_sqe *DSubmitEntries;
+    uint32_t *DCompleteHead;
+    uint32_t *DCompleteTail;
+    uint32_t DCompleteMask;
+    struct io_uring_cqe *DCompleteEntries;
+} SMachineUring, *SMachineUringRef;
+#endif
+
+// Regions that can be named in a request, indexed by region ID. Each side
+// fills in where it maps them; a server shared by several VMs would give
+// each VM's region its own ID.
+#define MACHINE_MAX_SHARE_REGIONS       8
+#define MACHINE_SHARE_REGION_INVALID    UINT32_MAX
+
+typedef struct{
+    uint8_t *DBase;
+    size_t DSize;
+} SMachineShareRegion, *SMachineShareRegionRef;
+
 static bool MachineInitialized = false;
 static SMachineData MachineData;
+static SMachineShareRegion MachineShareRegions[MACHINE_MAX_SHARE_REGIONS];
+static uint32_t MachineShareRegionCount = 0;
+#ifndef MACHINE_CONTEXT_ASM
 static SMachineContext MachineContextCaller;
-static sig_atomic_t MachineContextCalled;
 static SMachineContextRef MachineContextCreateRef;
 static void (*MachineContextCreateFunction)(void *);
 static void *MachineContextCreateParam;
-static sigset_t MachineContextCreateSignals;
+#endif
 //static volatile sig_atomic_t MachinePendingRequest = false;
-static int MachineSignalPipe[2];
 static TMachineAlarmCallback MachineAlarmCallback = NULL;
 static void *MachineAlarmCalldata = NULL;
+static TMachineReplyCallback MachineReplyCallback = NULL;
+static timer_t MachineAlarmTimer;
+static SMachineLatencyHistogram MachineLatency[MACHINE_REQUEST_TYPE_COUNT][MACHINE_LATENCY_STAGE_COUNT];
+static bool MachineLatencyReport = false;
+// Child side, when each callback slot's request was picked up
+static uint64_t MachinePickupTimes[MACHINE_MAX_PENDING_CALLBACKS];
+// Child side, when the oldest unwritten console bytes were first seen and
+// the ring tail as of the last look
+static uint64_t MachineConsoleSince[MACHINE_CONSOLE_COUNT];
+static uint32_t MachineConsoleSeen[MACHINE_CONSOLE_COUNT];
+static bool MachineAlarmTimerCreated = false;
+static void *MachineReplyCalldata = NULL;
 struct sigaction MachineAlarmActionSave;
-static volatile uint32_t MachineRequestID = 0;
-static std::map< uint32_t , SMachinePendingCallback > MachinePendingCallbacks;
+static SMachinePendingCallback MachinePendingCallbacks[MACHINE_MAX_PENDING_CALLBACKS];
+static uint32_t MachineFreeCallbackSlots[MACHINE_MAX_PENDING_CALLBACKS];
+static volatile int MachineFreeCallbackCount = 0;
+static SMachineBatchGroup MachineBatchGroups[MACHINE_MAX_BATCH_GROUPS];
+static int MachineEngine = MACHINE_ENGINE_POLL;
+static int MachineWorkerCount = MACHINE_DEFAULT_WORKERS;
+static int MachinePrefault = 0;
+static int MachineHugePages = 0;
+static std::map< int, SMachineReadAheadRef > MachineReadAheads;
+static bool MachineReplyLocked = false;
+static pthread_mutex_t MachineReplyMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef MACHINE_CONTEXT_ASM
+// A context is its stack pointer. Switching pushes rbp, rbx and r12-r15,
+// then the MXCSR and x87 control words, which are all the SysV ABI has the
+// callee keep; it stores rsp, loads the other context's and unwinds the
+// same frame there.
+__asm__(
+    ".text\n"
+    ".globl MachineContextSwitchAsm\n"
+    ".type MachineContextSwitchAsm, @function\n"
+    "MachineContextSwitchAsm:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size MachineContextSwitchAsm, .-MachineContextSwitchAsm\n"
+    // A new context returns here from its first switch with the entry in
+    // r12 and its parameter in r13
+    ".globl MachineContextStartAsm\n"
+    ".type MachineContextStartAsm, @function\n"
+    "MachineContextStartAsm:\n"
+    "    movq %r13, %rdi\n"
+    "    callq *%r12\n"
+    "    callq abort@PLT\n"
+    ".size MachineContextStartAsm, .-MachineContextStartAsm\n"
+);
+
+void MachineContextStartAsm(void);
+
+#define MACHINE_CONTEXT_MXCSR           0x1F80
+#define MACHINE_CONTEXT_FPU_CONTROL     0x037F
+
+// Lays out the frame MachineContextSwitchAsm unwinds at the top of the
+// stack, so the first switch to the context "returns" into the entry
+void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+    uint64_t *Frame = (uint64_t *)((((uintptr_t)stackaddr + stacksize) & ~(uintptr_t)15) - 16);
+    
+    *--Frame = (uint64_t)MachineContextStartAsm;
+    *--Frame = 0;                       // rbp
+    *--Frame = 0;                       // rbx
+    *--Frame = (uint64_t)entry;         // r12
+    *--Frame = (uint64_t)param;         // r13
+    *--Frame = 0;                       // r14
+    *--Frame = 0;                       // r15
+    *--Frame = MACHINE_CONTEXT_MXCSR | ((uint64_t)MACHINE_CONTEXT_FPU_CONTROL << 32);
+    mcntxref->DStackPointer = Frame;
+}
+#else
+void MachineContextCreateBoot(void);
+
+// Portable version: makecontext points a throwaway ucontext at the new
+// stack, and the boot routine running there saves the jmp_buf the context
+// starts from. Nothing else is needed since later switches never touch the
+// signal mask.
+void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+    ucontext_t BootContext;
+    
+    getcontext(&BootContext);
+    BootContext.uc_stack.ss_sp = stackaddr;
+    BootContext.uc_stack.ss_size = stacksize;
+    BootContext.uc_link = NULL;
+    makecontext(&BootContext, MachineContextCreateBoot, 0);
+    
+    MachineContextCreateRef = mcntxref;
+    MachineContextCreateFunction = entry;
+    MachineContextCreateParam = param;
+    if(MachineContextSave(&MachineContextCaller) == 0){
+        setcontext(&BootContext);
+    }
+}
+
+void MachineContextCreateBoot(void){
+    void (*MachineContextStartFunction)(void *) = MachineContextCreateFunction;
+    void *MachineContextStartParam = MachineContextCreateParam;
+    
+    // Hand the new context back to the creator, the first switch to it
+    // resumes here
+    MachineContextSwitch(MachineContextCreateRef, &MachineContextCaller);
+    
+    // The thread "magically" starts... 
+    MachineContextStartFunction(MachineContextStartParam);
+    
+    // NOTREACHED 
+    abort();
+}
+#endif
+
+uint32_t MachineAddShareRegion(uint8_t *base, size_t size){
+    if(MACHINE_MAX_SHARE_REGIONS <= MachineShareRegionCount){
+        return MACHINE_SHARE_REGION_INVALID;
+    }
+    MachineShareRegions[MachineShareRegionCount].DBase = base;
+    MachineShareRegions[MachineShareRegionCount].DSize = size;
+    return MachineShareRegionCount++;
+}
+
+// Names a buffer by region and offset. One outside every region gets an
+// invalid region, so the child fails the operation.
+void MachineSetReference(SMachineShareReferenceRef reference, void *data, int length){
+    uint8_t *Pointer = (uint8_t *)data;
+    
+    reference->DRegion = MACHINE_SHARE_REGION_INVALID;
+    reference->DOffset = 0;
+    reference->DLength = length;
+    for(uint32_t Region = 0; Region < MachineShareRegionCount; Region++){
+        SMachineShareRegionRef ShareRegion = &MachineShareRegions[Region];
+        
+        if((Pointer >= ShareRegion->DBase) && (Pointer < ShareRegion->DBase + ShareRegion->DSize)){
+            reference->DRegion = Region;
+            reference->DOffset = Pointer - ShareRegion->DBase;
+            return;
+        }
+    }
+}
+
+// Where a reference points in this process, NULL if it does not lie
+// entirely within its region
+uint8_t *MachineGetReference(SMachineShareReferenceRef reference){
+    SMachineShareRegionRef ShareRegion;
+    
+    if((MachineShareRegionCount <= reference->DRegion) || (0 > reference->DLength)){
+        return NULL;
+    }
+    ShareRegion = &MachineShareRegions[reference->DRegion];
+    if((ShareRegion->DSize <= reference->DOffset) || (ShareRegion->DSize - reference->DOffset < (size_t)reference->DLength)){
+        return NULL;
+    }
+    return ShareRegion->DBase + reference->DOffset;
+}
+
+// Returns how many bytes of the request need to be sent
+size_t MachineSetSegments(SMachineTransferRequestRef request, int fd, SMachineFileSegmentRef segments, int count, int offset){
+    request->DFileDescriptor = fd;
+    request->DCount = count;
+    request->DOffset = offset;
+    request->DReserved = 0;
+    for(int Index = 0; Index < count; Index++){
+        MachineSetReference(&request->DSegments[Index], segments[Index].DData, segments[Index].DLength);
+    }
+    return offsetof(SMachineTransferRequest, DSegments) + sizeof(SMachineShareReference) * (0 < count ? count : 0);
+}
+
+// Returns the segment count, or -1 if any segment falls outside the share
+int MachineGetSegments(SMachineTransferRequestRef request, struct iovec *segments){
+    int Count = request->DCount;
+    
+    if((0 > Count) || (MACHINE_MAX_FILE_SEGMENTS < Count)){
+        return -1;
+    }
+    for(int Index = 0; Index < Count; Index++){
+        uint8_t *Pointer = MachineGetReference(&request->DSegments[Index]);
+        
+        if(NULL == Pointer){
+            return -1;
+        }
+        segments[Index].iov_base = Pointer;
+        segments[Index].iov_len = request->DSegments[Index].DLength;
+    }
+    return Count;
+}
+
+void MachineBatchComplete(SMachinePendingCallback callinfo, int result){
+    SMachineBatchGroupRef Group = callinfo.DBatchGroup;
+    
+    callinfo.DBatchEntry->DResult = result;
+    if(0 > result){
+        Group->DFailed = true;
+    }
+    Group->DRemaining--;
+    if(callinfo.DBatchEntry->DCallback){
+        callinfo.DBatchEntry->DCallback(callinfo.DBatchEntry->DCalldata, result);
+    }
+    if(0 == Group->DRemaining){
+        TMachineFileCallback Callback = Group->DCallback;
+        void *Calldata = Group->DCalldata;
+        int Failed = Group->DFailed;
+        
+        Group->DCallback = NULL;
+        if(Callback){
+            Callback(Calldata, Failed ? -1 : 0);
+        }
+    }
+}
+
+uint64_t MachineNow(void){
+    struct timespec Now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (uint64_t)Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+}
+
+void MachineLatencyAdd(SMachineLatencyHistogramRef histogram, uint64_t start, uint64_t end){
+    uint64_t Latency = end > start ? end - start : 0;
+    int Bucket = 0;
+    
+    while((Bucket + 1 < MACHINE_LATENCY_BUCKETS) && (Latency >> (Bucket + 1))){
+        Bucket++;
+    }
+    histogram->DCount++;
+    histogram->DTotal += Latency;
+    if(Latency > histogram->DMaximum){
+        histogram->DMaximum = Latency;
+    }
+    histogram->DBuckets[Bucket]++;
+}
+
+void MachineLatencyRecord(SMachinePendingCallbackRef callinfo, SMachineReplySlotRef reply){
+    SMachineLatencyHistogramRef Histograms;
+    uint64_t Now = MachineNow();
+    
+    if(MACHINE_REQUEST_TYPE_COUNT <= callinfo->DType){
+        return;
+    }
+    Histograms = MachineLatency[callinfo->DType];
+    MachineLatencyAdd(&Histograms[MACHINE_LATENCY_QUEUE], callinfo->DSubmitTime, reply->DPickupTime);
+    MachineLatencyAdd(&Histograms[MACHINE_LATENCY_SERVICE], reply->DPickupTime, reply->DCompleteTime);
+    MachineLatencyAdd(&Histograms[MACHINE_LATENCY_REPLY], reply->DCompleteTime, Now);
+    MachineLatencyAdd(&Histograms[MACHINE_LATENCY_TOTAL], callinfo->DSubmitTime, Now);
+}
+
+// Upper bound of the bucket holding the given fraction of the samples
+uint64_t MachineLatencyPercentile(SMachineLatencyHistogramRef histogram, double fraction){
+    uint64_t Wanted = (uint64_t)(histogram->DCount * fraction);
+    uint64_t Seen = 0;
+    
+    for(int Bucket = 0; Bucket < MACHINE_LATENCY_BUCKETS; Bucket++){
+        Seen += histogram->DBuckets[Bucket];
+        if(Seen > Wanted){
+            return std::min((2ULL << Bucket) - 1, (unsigned long long)histogram->DMaximum);
+        }
+    }
+    return histogram->DMaximum;
+}
+
+void MachineReportLatency(int fd){
+    static const char *TypeNames[MACHINE_REQUEST_TYPE_COUNT] = {"", "none", "open", "read", "write", "seek", "close", "terminate", "batch", "pread", "pwrite", "sync", "datasync", "cancel"};
+    static const char *StageNames[MACHINE_LATENCY_STAGE_COUNT] = {"queue", "service", "reply", "total"};
+    
+    dprintf(fd, "Machine request latency (us)\n");
+    dprintf(fd, "%-8s %-8s %10s %10s %10s %10s %10s\n", "type", "stage", "count", "mean", "p50", "p99", "max");
+    for(int Type = 0; Type < MACHINE_REQUEST_TYPE_COUNT; Type++){
+        for(int Stage = 0; Stage < MACHINE_LATENCY_STAGE_COUNT; Stage++){
+            SMachineLatencyHistogramRef Histogram = &MachineLatency[Type][Stage];
+            
+            if(0 == Histogram->DCount){
+                continue;
+            }
+            dprintf(fd, "%-8s %-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", TypeNames[Type], StageNames[Stage], (unsigned long long)Histogram->DCount, Histogram->DTotal / 1000.0 / Histogram->DCount, MachineLatencyPercentile(Histogram, 0.5) / 1000.0, MachineLatencyPercentile(Histogram, 0.99) / 1000.0, Histogram->DMaximum / 1000.0);
+            dprintf(fd, "        ");
+            for(int Bucket = 0; Bucket < MACHINE_LATENCY_BUCKETS; Bucket++){
+                if(Histogram->DBuckets[Bucket]){
+                    dprintf(fd, " <%.3gus:%llu", (2ULL << Bucket) / 1000.0, (unsigned long long)Histogram->DBuckets[Bucket]);
+                }
+            }
+            dprintf(fd, "\n");
+        }
+    }
+}
+
+void MachineSetLatencyReport(int report){
+    MachineLatencyReport = report;
+}
+
+// Runs the callbacks of every reply that has arrived, returning how many
+// there were. Without a reply callback this is done by the SIGUSR2 handler.
+int MachineProcessReplies(void){
+    SMachineRingsRef Rings = MachineData.DRings;
+    SMachineReplySlot Reply;
+    uint32_t Head;
+    int Count = 0;
+    
+    // Clear before draining so a reply posted after this point signals again
+    __atomic_store_n(&Rings->DReplySignaled, 0, __ATOMIC_SEQ_CST);
+    while(true){
+        Head = Rings->DReplyHead;
+        if(Head == __atomic_load_n(&Rings->DReplyTail, __ATOMIC_ACQUIRE)){
+            break;
+        }
+        Reply = Rings->DReplies[Head % MACHINE_REPLY_RING_COUNT];
+        __atomic_store_n(&Rings->DReplyHead, Head + 1, __ATOMIC_RELEASE);
+        Count++;
+        SMachinePendingCallbackRef Slot = &MachinePendingCallbacks[Reply.DRequestID & MACHINE_PENDING_INDEX_MASK];
+        if(Slot->DInUse && (Slot->DRequestID == Reply.DRequestID)){
+            SMachinePendingCallback Callinfo = *Slot;
+            
+            Slot->DInUse = false;
+            MachineFreeCallbackSlots[MachineFreeCallbackCount++] = Reply.DRequestID & MACHINE_PENDING_INDEX_MASK;
+            MachineLatencyRecord(&Callinfo, &Reply);
+            if(Callinfo.DBatchGroup){
+                MachineBatchComplete(Callinfo, Reply.DResult);
+            }
+            else{
+                Callinfo.DCallback(Callinfo.DCalldata, Reply.DResult);
+            }
+        }
+        else{
+            fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",Reply.DRequestID);
+        }
+    }
+    return Count;
+}
+
+void MachineReplySignalHandler(int signum){
+    if(MachineReplyCallback){
+        MachineReplyCallback(MachineReplyCalldata);
+    }
+    else{
+        MachineProcessReplies();
+    }
+}
+
+// Requests mask signals so the reply handler cannot run the callbacks
+// midway. With a reply callback the caller does its own exclusion.
+void MachineBeginRequest(TMachineSignalStateRef sigstate){
+    if(!MachineReplyCallback){
+        MachineSuspendSignals(sigstate);
+    }
+}
+
+void MachineEndRequest(TMachineSignalStateRef sigstate){
+    if(!MachineReplyCallback){
+        MachineResumeSignals(sigstate);
+    }
+}
+
+void MachineInitializeCallbackSlots(void){
+    for(int Index = 0; Index < MACHINE_MAX_PENDING_CALLBACKS; Index++){
+        MachinePendingCallbacks[Index].DInUse = false;
+        MachinePendingCallbacks[Index].DGeneration = 0;
+        MachineFreeCallbackSlots[Index] = MACHINE_MAX_PENDING_CALLBACKS - 1 - Index;
+    }
+    MachineFreeCallbackCount = MACHINE_MAX_PENDING_CALLBACKS;
+}
+
+// Must be called with signals suspended. If every slot is taken the reply
+// ring is drained here until one frees up.
+SMachinePendingCallbackRef MachineAllocateCallbackSlot(void){
+    SMachinePendingCallbackRef Slot;
+    uint32_t Index;
+    
+    while(0 == MachineFreeCallbackCount){
+        MachineProcessReplies();
+        if(0 == MachineFreeCallbackCount){
+            sched_yield();
+        }
+    }
+    Index = MachineFreeCallbackSlots[--MachineFreeCallbackCount];
+    Slot = &MachinePendingCallbacks[Index];
+    Slot->DGeneration++;
+    Slot->DRequestID = (Slot->DGeneration << MACHINE_PENDING_INDEX_BITS) | Index;
+    Slot->DInUse = true;
+    return Slot;
+}
+
+uint32_t MachineAddRequest(TMachineFileCallback callback, void *calldata){
+    SMachinePendingCallbackRef Slot = MachineAllocateCallbackSlot();
+    
+    Slot->DCallback = callback;
+    Slot->DCalldata = calldata;
+    Slot->DBatchEntry = NULL;
+    Slot->DBatchGroup = NULL;
+    return Slot->DRequestID;
+}
+
+uint32_t MachineAddBatchRequest(SMachineBatchEntryRef entry, SMachineBatchGroupRef group){
+    SMachinePendingCallbackRef Slot = MachineAllocateCallbackSlot();
+    
+    Slot->DCallback = NULL;
+    Slot->DCalldata = NULL;
+    Slot->DBatchEntry = entry;
+    Slot->DBatchGroup = group;
+    return Slot->DRequestID;
+}
+
+// Notes the request type and submit time in the callback slot of each
+// operation the request carries
+void MachineStampSubmit(SMachineRequestRef request){
+    uint64_t Now = MachineNow();
+    
+    if(MACHINE_REQUEST_CANCEL == request->DHeader.DType){
+        return;
+    }
+    if(MACHINE_REQUEST_BATCH == request->DHeader.DType){
+        for(int Index = 0; (Index < request->DBatch.DCount) && (Index < MACHINE_MAX_BATCH_REQUEST_ENTRIES); Index++){
+            SMachinePendingCallbackRef Slot = &MachinePendingCallbacks[request->DBatch.DEntries[Index].DRequestID & MACHINE_PENDING_INDEX_MASK];
+            
+            Slot->DType = MACHINE_REQUEST_BATCH;
+            Slot->DSubmitTime = Now;
+        }
+    }
+    else{
+        SMachinePendingCallbackRef Slot = &MachinePendingCallbacks[request->DHeader.DRequestID & MACHINE_PENDING_INDEX_MASK];
+        
+        Slot->DType = request->DHeader.DType;
+        Slot->DSubmitTime = Now;
+    }
+}
+
+// Must be called with signals suspended, the parent is the only producer
+void MachineSendRequest(SMachineRequestRef request, size_t length){
+    SMachineRingsRef Rings = MachineData.DRings;
+    uint32_t Tail = Rings->DRequestTail;
+    uint64_t Doorbell = 1;
+    
+    // The child may itself be stuck on a full reply ring, so replies are
+    // drained while waiting. Callers hold the scheduler lock, which keeps
+    // the callbacks out of signal context.
+    while(MACHINE_REQUEST_RING_COUNT <= Tail - __atomic_load_n(&Rings->DRequestHead, __ATOMIC_ACQUIRE)){
+        write(MachineData.DRequestDoorbell, &Doorbell, sizeof(Doorbell));
+        if(!MachineProcessReplies()){
+            sched_yield();
+        }
+    }
+    Rings->DRequests[Tail % MACHINE_REQUEST_RING_COUNT].DLength = length;
+    MachineStampSubmit(request);
+    memcpy(&Rings->DRequests[Tail % MACHINE_REQUEST_RING_COUNT].DMessage, request, length);
+    __atomic_store_n(&Rings->DRequestTail, Tail + 1, __ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&Rings->DRequestSleeping, 0, __ATOMIC_SEQ_CST)){
+        write(MachineData.DRequestDoorbell, &Doorbell, sizeof(Doorbell));
+    }
+}
+
+// Called by the child, which is the only producer of replies. With the
+// worker engine the threads take turns producing under MachineReplyMutex.
+void MachineSendResult(uint32_t requestid, int result){
+    SMachineRingsRef Rings = MachineData.DRings;
+    uint32_t Tail;
+    
+    if(MachineReplyLocked){
+        pthread_mutex_lock(&MachineReplyMutex);
+    }
+    Tail = Rings->DReplyTail;
+    while(MACHINE_REPLY_RING_COUNT <= Tail - __atomic_load_n(&Rings->DReplyHead, __ATOMIC_ACQUIRE)){
+        if((0 > kill(MachineData.DParentPID, SIGUSR2)) && (ESRCH == errno)){
+            if(MachineReplyLocked){
+                pthread_mutex_unlock(&MachineReplyMutex);
+            }
+            return;
+        }
+        sched_yield();
+    }
+    Rings->DReplies[Tail % MACHINE_REPLY_RING_COUNT].DRequestID = requestid;
+    Rings->DReplies[Tail % MACHINE_REPLY_RING_COUNT].DResult = result;
+    Rings->DReplies[Tail % MACHINE_REPLY_RING_COUNT].DPickupTime = MachinePickupTimes[requestid & MACHINE_PENDING_INDEX_MASK];
+    Rings->DReplies[Tail % MACHINE_REPLY_RING_COUNT].DCompleteTime = MachineNow();
+    __atomic_store_n(&Rings->DReplyTail, Tail + 1, __ATOMIC_SEQ_CST);
+    if(!__atomic_exchange_n(&Rings->DReplySignaled, 1, __ATOMIC_SEQ_CST)){
+        kill(MachineData.DParentPID, SIGUSR2);
+    }
+    if(MachineReplyLocked){
+        pthread_mutex_unlock(&MachineReplyMutex);
+    }
+}
+
+// Posts a result only if the reply ring has room, for use at shutdown when
+// the parent is no longer draining replies
+void MachineSendResultNoWait(uint32_t requestid, int result){
+    SMachineRingsRef Rings = MachineData.DRings;
+    
+    if(MACHINE_REPLY_RING_COUNT > Rings->DReplyTail - __atomic_load_n(&Rings->DReplyHead, __ATOMIC_ACQUIRE)){
+        MachineSendResult(requestid, result);
+    }
+}
+
+// Writes console bytes from head up to end, returns the new head. Bytes
+// that cannot be written are dropped so a closed console cannot wedge
+// the ring.
+uint32_t MachineConsoleDrain(SMachineConsoleRingRef console, int fd, uint32_t head, uint32_t end){
+    while(head != end){
+        struct iovec Segments[2];
+        uint32_t Start = head % MACHINE_CONSOLE_RING_SIZE;
+        uint32_t Length = end - head;
+        int Count = 1;
+        ssize_t Result;
+        
+        Segments[0].iov_base = console->DData + Start;
+        Segments[0].iov_len = Length;
+        if(MACHINE_CONSOLE_RING_SIZE < Start + Length){
+            Segments[0].iov_len = MACHINE_CONSOLE_RING_SIZE - Start;
+            Segments[1].iov_base = console->DData;
+            Segments[1].iov_len = Length - Segments[0].iov_len;
+            Count = 2;
+        }
+        do{
+            Result = writev(fd, Segments, Count);
+        }while((-1 == Result) && (EINTR == errno));
+        if(0 >= Result){
+            return end;
+        }
+        head += Result;
+    }
+    return head;
+}
+
+// Writes out the console bytes that are due, everything if flush is set.
+// Returns the milliseconds until the next partial line is due, or -1 if
+// nothing is left waiting.
+int MachineConsoleService(bool flush){
+    int Timeout = -1;
+    
+    for(int Index = 0; Index < MACHINE_CONSOLE_COUNT; Index++){
+        SMachineConsoleRingRef Console = &MachineData.DRings->DConsoles[Index];
+        uint32_t Head = Console->DHead;
+        uint32_t Tail = __atomic_load_n(&Console->DTail, __ATOMIC_ACQUIRE);
+        uint32_t End = Head;
+        uint64_t Now;
+        
+        MachineConsoleSeen[Index] = Tail;
+        if(Head == Tail){
+            MachineConsoleSince[Index] = 0;
+            continue;
+        }
+        Now = MachineNow();
+        if(0 == MachineConsoleSince[Index]){
+            MachineConsoleSince[Index] = Now;
+        }
+        if(flush || (MACHINE_CONSOLE_RING_SIZE / 2 <= Tail - Head) || (MachineConsoleSince[Index] + MACHINE_CONSOLE_DEADLINE_MS * 1000000ULL <= Now)){
+            End = Tail;
+        }
+        else{
+            for(uint32_t Position = Tail; Position != Head; Position--){
+                if('\n' == Console->DData[(Position - 1) % MACHINE_CONSOLE_RING_SIZE]){
+                    End = Position;
+                    break;
+                }
+            }
+        }
+        if(End != Head){
+            Head = MachineConsoleDrain(Console, STDOUT_FILENO + Index, Head, End);
+            __atomic_store_n(&Console->DHead, Head, __ATOMIC_RELEASE);
+            MachineConsoleSince[Index] = Head == Tail ? 0 : Now;
+        }
+        if(Head != Tail){
+            int Remaining = (MachineConsoleSince[Index] + MACHINE_CONSOLE_DEADLINE_MS * 1000000ULL - Now + 999999) / 1000000;
+            
+            if((0 > Timeout) || (Remaining < Timeout)){
+                Timeout = Remaining;
+            }
+        }
+    }
+    return Timeout;
+}
+
+// True if console bytes arrived since MachineConsoleService last looked,
+// checked after the child says it is going to sleep
+bool MachineConsoleChanged(void){
+    for(int Index = 0; Index < MACHINE_CONSOLE_COUNT; Index++){
+        if(MachineConsoleSeen[Index] != __atomic_load_n(&MachineData.DRings->DConsoles[Index].DTail, __ATOMIC_SEQ_CST)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// Console bytes buffered before a write to the same descriptor go out
+// ahead of it
+void MachineConsoleBarrier(SMachineRequestRef request){
+    switch(request->DHeader.DType){
+        case MACHINE_REQUEST_WRITE:
+        case MACHINE_REQUEST_PWRITE:    if((STDOUT_FILENO == request->DTransfer.DFileDescriptor) || (STDERR_FILENO == request->DTransfer.DFileDescriptor)){
+                                            MachineConsoleService(true);
+                                        }
+                                        break;
+        case MACHINE_REQUEST_BATCH:     for(int Index = 0; (Index < request->DBatch.DCount) && (Index < MACHINE_MAX_BATCH_REQUEST_ENTRIES); Index++){
+                                            SMachineBatchRequestEntryRef Entry = &request->DBatch.DEntries[Index];
+                                            
+                                            if(((MACHINE_BATCH_WRITE == Entry->DOperation) || (MACHINE_BATCH_WRITE_AT == Entry->DOperation)) && ((STDOUT_FILENO == Entry->DFileDescriptor) || (STDERR_FILENO == Entry->DFileDescriptor))){
+                                                MachineConsoleService(true);
+                                                break;
+                                            }
+                                        }
+                                        break;
+        default:                        break;
+    }
+}
+
+// Called by the child, copies out the next request if there is one
+bool MachineReceiveRequest(SMachineRequestRef request){
+    SMachineRingsRef Rings = MachineData.DRings;
+    uint32_t Head = Rings->DRequestHead;
+    SMachineRequestSlotRef Slot;
+    uint32_t Length;
+    uint64_t Now;
+    
+    if(Head == __atomic_load_n(&Rings->DRequestTail, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+    Slot = &Rings->DRequests[Head % MACHINE_REQUEST_RING_COUNT];
+    // The length is written by the parent, read it once and keep the copy
+    // inside the request
+    Length = __atomic_load_n(&Slot->DLength, __ATOMIC_RELAXED);
+    if(sizeof(SMachineRequest) < Length){
+        Length = sizeof(SMachineRequest);
+    }
+    memcpy(request, &Slot->DMessage, Length);
+    __atomic_store_n(&Rings->DRequestHead, Head + 1, __ATOMIC_RELEASE);
+    Now = MachineNow();
+    if(MACHINE_REQUEST_BATCH == request->DHeader.DType){
+        for(int Index = 0; (Index < request->DBatch.DCount) && (Index < MACHINE_MAX_BATCH_REQUEST_ENTRIES); Index++){
+            MachinePickupTimes[request->DBatch.DEntries[Index].DRequestID & MACHINE_PENDING_INDEX_MASK] = Now;
+        }
+    }
+    else if(MACHINE_REQUEST_CANCEL != request->DHeader.DType){
+        MachinePickupTimes[request->DHeader.DRequestID & MACHINE_PENDING_INDEX_MASK] = Now;
+    }
+    MachineConsoleBarrier(request);
+    return true;
+}
+
+void MachineFreeOperation(SMachineOperationRef operation){
+    free(operation->DFileName);
+    delete operation;
+}
+
+// Splits a request into the operations it carries, replying straight away
+// to any that are malformed. Returns false for a terminate request.
+bool MachineDecodeRequest(SMachineRequestRef request, std::vector< SMachineOperationRef > &operations){
+    SMachineOperationRef Operation;
+    
+    switch(request->DHeader.DType){
+        case MACHINE_REQUEST_OPEN:      Operation = new SMachineOperation();
+                                        Operation->DRequestID = request->DHeader.DRequestID;
+                                        Operation->DOperation = MACHINE_BATCH_OPEN;
+                                        Operation->DFileName = strndup(request->DOpen.DFileName, PATH_MAX - 1);
+                                        Operation->DArgument1 = request->DOpen.DFlags;
+                                        Operation->DArgument2 = request->DOpen.DMode;
+                                        operations.push_back(Operation);
+                                        break;
+        case MACHINE_REQUEST_READ:
+        case MACHINE_REQUEST_WRITE:
+        case MACHINE_REQUEST_PREAD:
+        case MACHINE_REQUEST_PWRITE:    Operation = new SMachineOperation();
+                                        Operation->DRequestID = request->DHeader.DRequestID;
+                                        switch(request->DHeader.DType){
+                                            case MACHINE_REQUEST_READ:      Operation->DOperation = MACHINE_BATCH_READ;
+                                                                            break;
+                                            case MACHINE_REQUEST_WRITE:     Operation->DOperation = MACHINE_BATCH_WRITE;
+                                                                            break;
+                                            case MACHINE_REQUEST_PREAD:     Operation->DOperation = MACHINE_BATCH_READ_AT;
+                                                                            break;
+                                            default:                        Operation->DOperation = MACHINE_BATCH_WRITE_AT;
+                                                                            break;
+                                        }
+                                        Operation->DFileDescriptor = request->DTransfer.DFileDescriptor;
+                                        Operation->DArgument1 = request->DTransfer.DOffset;
+                                        Operation->DCount = MachineGetSegments(&request->DTransfer, Operation->DSegments);
+                                        if(0 > Operation->DCount){
+                                            MachineSendResult(Operation->DRequestID, -1);
+                                            MachineFreeOperation(Operation);
+                                            break;
+                                        }
+                                        operations.push_back(Operation);
+                                        break;
+        case MACHINE_REQUEST_SEEK:      Operation = new SMachineOperation();
+                                        Operation->DRequestID = request->DHeader.DRequestID;
+                                        Operation->DOperation = MACHINE_BATCH_SEEK;
+                                        Operation->DFileDescriptor = request->DSeek.DFileDescriptor;
+                                        Operation->DArgument1 = request->DSeek.DOffset;
+                                        Operation->DArgument2 = request->DSeek.DWhence;
+                                        operations.push_back(Operation);
+                                        break;
+        case MACHINE_REQUEST_CLOSE:     Operation = new SMachineOperation();
+                                        Operation->DRequestID = request->DHeader.DRequestID;
+                                        Operation->DOperation = MACHINE_BATCH_CLOSE;
+                                        Operation->DFileDescriptor = request->DClose.DFileDescriptor;
+                                        operations.push_back(Operation);
+                                        break;
+        case MACHINE_REQUEST_SYNC:
+        case MACHINE_REQUEST_DATASYNC:  Operation = new SMachineOperation();
+                                        Operation->DRequestID = request->DHeader.DRequestID;
+                                        Operation->DOperation = MACHINE_REQUEST_SYNC == request->DHeader.DType ? MACHINE_BATCH_SYNC : MACHINE_BATCH_DATASYNC;
+                                        Operation->DFileDescriptor = request->DSync.DFileDescriptor;
+                                        operations.push_back(Operation);
+                                        break;
+        case MACHINE_REQUEST_BATCH:     for(int Index = 0; (Index < request->DBatch.DCount) && (Index < MACHINE_MAX_BATCH_REQUEST_ENTRIES); Index++){
+                                            SMachineBatchRequestEntryRef Entry = &request->DBatch.DEntries[Index];
+                                            bool Valid = (0 <= Entry->DOperation) && (MACHINE_BATCH_DATASYNC >= Entry->DOperation);
+                                            
+                                            Operation = new SMachineOperation();
+                                            Operation->DOperation = Entry->DOperation;
+                                            Operation->DRequestID = Entry->DRequestID;
+                                            Operation->DFileDescriptor = Entry->DFileDescriptor;
+                                            Operation->DArgument1 = Entry->DArgument1;
+                                            // The engines keep their own state in DArgument2 of other operations
+                                            Operation->DArgument2 = ((MACHINE_BATCH_OPEN == Entry->DOperation) || (MACHINE_BATCH_SEEK == Entry->DOperation)) ? Entry->DArgument2 : 0;
+                                            if(MACHINE_BATCH_OPEN == Entry->DOperation){
+                                                Valid = (0 <= Entry->DNameOffset) && (Entry->DNameOffset < request->DBatch.DNamesLength) && (PATH_MAX >= request->DBatch.DNamesLength);
+                                                if(Valid){
+                                                    Operation->DFileName = strndup(request->DBatch.DNames + Entry->DNameOffset, request->DBatch.DNamesLength - Entry->DNameOffset);
+                                                }
+                                            }
+                                            else if((MACHINE_BATCH_READ == Entry->DOperation) || (MACHINE_BATCH_WRITE == Entry->DOperation) || (MACHINE_BATCH_READ_AT == Entry->DOperation) || (MACHINE_BATCH_WRITE_AT == Entry->DOperation)){
+                                                Operation->DSegments[0].iov_base = MachineGetReference(&Entry->DData);
+                                                Operation->DSegments[0].iov_len = Entry->DData.DLength;
+                                                Operation->DCount = 1;
+                                                Valid = NULL != Operation->DSegments[0].iov_base;
+                                            }
+                                            if(!Valid){
+                                                MachineSendResult(Operation->DRequestID, -1);
+                                                MachineFreeOperation(Operation);
+                                                continue;
+                                            }
+                                            operations.push_back(Operation);
+                                        }
+                                        break;
+        case MACHINE_REQUEST_TERMINATE: return false;
+        default:                        break;
+    }
+    return true;
+}
+
+// Performs an operation synchronously, returning what the syscall returned
+int MachineExecuteOperation(SMachineOperationRef operation){
+    int Result;
+    
+    switch(operation->DOperation){
+        case MACHINE_BATCH_OPEN:    return open(operation->DFileName, operation->DArgument1, operation->DArgument2);
+        case MACHINE_BATCH_READ:    do{
+                                        Result = readv(operation->DFileDescriptor, operation->DSegments, operation->DCount);
+                                    }while((-1 == Result) && (EINTR == errno));
+                                    return Result;
+        case MACHINE_BATCH_WRITE:   do{
+                                        Result = writev(operation->DFileDescriptor, operation->DSegments, operation->DCount);
+                                    }while((-1 == Result) && (EINTR == errno));
+                                    return Result;
+        case MACHINE_BATCH_SEEK:    return lseek(operation->DFileDescriptor, operation->DArgument1, operation->DArgument2);
+        case MACHINE_BATCH_CLOSE:   return close(operation->DFileDescriptor);
+        case MACHINE_BATCH_READ_AT: do{
+                                        Result = preadv(operation->DFileDescriptor, operation->DSegments, operation->DCount, operation->DArgument1);
+                                    }while((-1 == Result) && (EINTR == errno));
+                                    return Result;
+        case MACHINE_BATCH_WRITE_AT:do{
+                                        Result = pwritev(operation->DFileDescriptor, operation->DSegments, operation->DCount, operation->DArgument1);
+                                    }while((-1 == Result) && (EINTR == errno));
+                                    return Result;
+        case MACHINE_BATCH_SYNC:    return fsync(operation->DFileDescriptor);
+        case MACHINE_BATCH_DATASYNC:return fdatasync(operation->DFileDescriptor);
+        default:                    return -1;
+    }
+}
+
+bool MachineIsSync(int operation){
+    return (MACHINE_BATCH_SYNC == operation) || (MACHINE_BATCH_DATASYNC == operation);
+}
+
+// Counts the syncs at the front of a descriptor's queue. One flush answers
+// them all, so the first becomes a full sync if any of them is.
+size_t MachineSyncGroup(std::deque< SMachineOperationRef > &queue){
+    size_t Count = 0;
+    
+    while((Count < queue.size()) && MachineIsSync(queue[Count]->DOperation)){
+        if(MACHINE_BATCH_SYNC == queue[Count]->DOperation){
+            queue.front()->DOperation = MACHINE_BATCH_SYNC;
+        }
+        Count++;
+    }
+    return Count;
+}
+
+int MachineSegmentsLength(const struct iovec *segments, int count){
+    int Length = 0;
+    
+    for(int Index = 0; Index < count; Index++){
+        Length += segments[Index].iov_len;
+    }
+    return Length;
+}
+
+// Copies up to length bytes of data into the segments, returning how many
+// bytes were copied
+int MachineCopyToSegments(const struct iovec *segments, int count, const uint8_t *data, int length){
+    int Copied = 0;
+    
+    for(int Index = 0; (Index < count) && (Copied < length); Index++){
+        int Chunk = (int)segments[Index].iov_len < length - Copied ? (int)segments[Index].iov_len : length - Copied;
+        
+        memcpy(segments[Index].iov_base, data + Copied, Chunk);
+        Copied += Chunk;
+    }
+    return Copied;
+}
+
+// Returns the read buffer of a descriptor, creating it on first use.
+// Returns NULL for descriptors that are neither regular files nor streams.
+SMachineReadAheadRef MachineGetReadAhead(int fd){
+    auto Search = MachineReadAheads.find(fd);
+    SMachineReadAheadRef ReadAhead;
+    struct stat Status;
+    
+    if(MachineReadAheads.end() != Search){
+        return Search->second;
+    }
+    if(0 > fstat(fd, &Status)){
+        return NULL;
+    }
+    if(!S_ISREG(Status.st_mode) && !S_ISFIFO(Status.st_mode) && !S_ISCHR(Status.st_mode) && !S_ISSOCK(Status.st_mode)){
+        return NULL;
+    }
+    ReadAhead = new SMachineReadAhead;
+    ReadAhead->DStream = !S_ISREG(Status.st_mode);
+    ReadAhead->DDevice = Status.st_dev;
+    ReadAhead->DInode = Status.st_ino;
+    ReadAhead->DOffset = 0;
+    ReadAhead->DNextOffset = 0;
+    ReadAhead->DSequential = 0;
+    ReadAhead->DStart = 0;
+    ReadAhead->DLength = 0;
+    MachineReadAheads[fd] = ReadAhead;
+    return ReadAhead;
+}
+
+// Drops the buffered bytes of every descriptor open on the same file as
+// fd, called before anything is written through fd
+void MachineInvalidateReadAhead(int fd){
+    struct stat Status;
+    
+    if(MachineReadAheads.empty() || (0 > fstat(fd, &Status))){
+        return;
+    }
+    for(auto &ReadAhead : MachineReadAheads){
+        if(!ReadAhead.second->DStream && (ReadAhead.second->DDevice == Status.st_dev) && (ReadAhead.second->DInode == Status.st_ino)){
+            ReadAhead.second->DLength = 0;
+        }
+    }
+}
+
+void MachineReleaseReadAhead(int fd){
+    auto Search = MachineReadAheads.find(fd);
+    
+    if(MachineReadAheads.end() != Search){
+        delete Search->second;
+        MachineReadAheads.erase(Search);
+    }
+}
+
+// Positional read that is served from the read ahead buffer when it holds
+// the whole range, and that refills the buffer once fd is being read
+// sequentially
+int MachineReadAheadAt(int fd, const struct iovec *segments, int count, off_t offset){
+    SMachineReadAheadRef ReadAhead = MachineGetReadAhead(fd);
+    int Length = MachineSegmentsLength(segments, count);
+    int Result;
+    
+    if((NULL != ReadAhead) && !ReadAhead->DStream && (0 <= offset)){
+        if((offset >= ReadAhead->DOffset) && (offset + Length <= ReadAhead->DOffset + ReadAhead->DLength)){
+            ReadAhead->DNextOffset = offset + Length;
+            return MachineCopyToSegments(segments, count, ReadAhead->DData + (offset - ReadAhead->DOffset), Length);
+        }
+        ReadAhead->DSequential = offset == ReadAhead->DNextOffset ? ReadAhead->DSequential + 1 : 0;
+        ReadAhead->DNextOffset = offset + Length;
+        if((MACHINE_READAHEAD_TRIGGER <= ReadAhead->DSequential) && (MACHINE_READAHEAD_SIZE > Length)){
+            do{
+                Result = pread(fd, ReadAhead->DData, MACHINE_READAHEAD_SIZE, offset);
+            }while((-1 == Result) && (EINTR == errno));
+            if(0 > Result){
+                ReadAhead->DLength = 0;
+                return Result;
+            }
+            ReadAhead->DOffset = offset;
+            ReadAhead->DLength = Result;
+            return MachineCopyToSegments(segments, count, ReadAhead->DData, Result);
+        }
+    }
+    do{
+        Result = preadv(fd, segments, count, offset);
+    }while((-1 == Result) && (EINTR == errno));
+    return Result;
+}
+
+// Serves a stream read from what an earlier read left in the buffer.
+// Returns false if nothing is buffered for fd.
+bool MachineReadBuffered(int fd, const struct iovec *segments, int count, int *result){
+    auto Search = MachineReadAheads.find(fd);
+    
+    if((MachineReadAheads.end() == Search) || !Search->second->DStream || (0 == Search->second->DLength)){
+        return false;
+    }
+    *result = MachineCopyToSegments(segments, count, Search->second->DData + Search->second->DStart, Search->second->DLength);
+    Search->second->DStart += *result;
+    Search->second->DLength -= *result;
+    return true;
+}
+
+// Reads a stream that poll reported as readable. Small reads take all that
+// is available so the following ones are served without a syscall.
+int MachineReadStream(int fd, const struct iovec *segments, int count){
+    SMachineReadAheadRef ReadAhead = MachineGetReadAhead(fd);
+    int Result;
+    
+    if((NULL == ReadAhead) || !ReadAhead->DStream || (MACHINE_READAHEAD_SIZE <= MachineSegmentsLength(segments, count))){
+        do{
+            Result = readv(fd, segments, count);
+        }while((-1 == Result) && (EINTR == errno));
+        return Result;
+    }
+    do{
+        Result = read(fd, ReadAhead->DData, MACHINE_READAHEAD_SIZE);
+    }while((-1 == Result) && (EINTR == errno));
+    if(0 >= Result){
+        return Result;
+    }
+    ReadAhead->DStart = 0;
+    ReadAhead->DLength = Result;
+    MachineReadBuffered(fd, segments, count, &Result);
+    return Result;
+}
+
+// Runs decoded operations in order and replies for each one. Reads are
+// done inline rather than parked, so this is only used for batches and
+// positional requests, which should not block. A run of positional reads
+// or writes on one descriptor, each starting where the last one ended, is
+// merged into a single syscall.
+void MachineExecuteInline(std::vector< SMachineOperationRef > &operations){
+    std::vector< struct iovec > Segments;
+    std::vector< SMachineOperationRef > DeferredSyncs;
+    size_t Index = 0;
+    
+    while(Index < operations.size()){
+        SMachineOperationRef Operation = operations[Index];
+        size_t End = Index + 1;
+        int Result;
+        
+        if((MACHINE_BATCH_READ_AT == Operation->DOperation) || (MACHINE_BATCH_WRITE_AT == Operation->DOperation)){
+            off_t NextOffset = (off_t)Operation->DArgument1 + MachineSegmentsLength(Operation->DSegments, Operation->DCount);
+            
+            Segments.assign(Operation->DSegments, Operation->DSegments + Operation->DCount);
+            while(End < operations.size()){
+                SMachineOperationRef Next = operations[End];
+                
+                if((Next->DOperation != Operation->DOperation) || (Next->DFileDescriptor != Operation->DFileDescriptor) || (Next->DArgument1 != NextOffset) || (IOV_MAX < Segments.size() + Next->DCount)){
+                    break;
+                }
+                Segments.insert(Segments.end(), Next->DSegments, Next->DSegments + Next->DCount);
+                NextOffset += MachineSegmentsLength(Next->DSegments, Next->DCount);
+                End++;
+            }
+            if(MACHINE_BATCH_READ_AT == Operation->DOperation){
+                Result = MachineReadAheadAt(Operation->DFileDescriptor, Segments.data(), Segments.size(), Operation->DArgument1);
+            }
+            else{
+                MachineInvalidateReadAhead(Operation->DFileDescriptor);
+                do{
+                    Result = pwritev(Operation->DFileDescriptor, Segments.data(), Segments.size(), Operation->DArgument1);
+                }while((-1 == Result) && (EINTR == errno));
+            }
+            // Each operation gets its share of the merged transfer in order
+            for(size_t Merged = Index; Merged < End; Merged++){
+                int Length = MachineSegmentsLength(operations[Merged]->DSegments, operations[Merged]->DCount);
+                int Share = (0 > Result) || (Result < Length) ? Result : Length;
+                
+                MachineSendResult(operations[Merged]->DRequestID, Share);
+                if(0 < Share){
+                    Result -= Share;
+                }
+            }
+        }
+        else if(MachineIsSync(Operation->DOperation)){
+            size_t Later = Index + 1;
+            
+            // A later sync of the descriptor covers this one too, so it
+            // waits for that flush unless the descriptor is closed first
+            while(Later < operations.size()){
+                if((operations[Later]->DFileDescriptor == Operation->DFileDescriptor) && (MachineIsSync(operations[Later]->DOperation) || (MACHINE_BATCH_CLOSE == operations[Later]->DOperation))){
+                    break;
+                }
+                Later++;
+            }
+            if((Later < operations.size()) && MachineIsSync(operations[Later]->DOperation)){
+                if(MACHINE_BATCH_SYNC == Operation->DOperation){
+                    operations[Later]->DOperation = MACHINE_BATCH_SYNC;
+                }
+                DeferredSyncs.push_back(Operation);
+                Index++;
+                continue;
+            }
+            Result = MachineExecuteOperation(Operation);
+            for(size_t Deferred = 0; Deferred < DeferredSyncs.size();){
+                if(DeferredSyncs[Deferred]->DFileDescriptor == Operation->DFileDescriptor){
+                    MachineSendResult(DeferredSyncs[Deferred]->DRequestID, Result);
+                    MachineFreeOperation(DeferredSyncs[Deferred]);
+                    DeferredSyncs.erase(DeferredSyncs.begin() + Deferred);
+                }
+                else{
+                    Deferred++;
+                }
+            }
+            MachineSendResult(Operation->DRequestID, Result);
+        }
+        else{
+            if(MACHINE_BATCH_WRITE == Operation->DOperation){
+                MachineInvalidateReadAhead(Operation->DFileDescriptor);
+            }
+            else if(MACHINE_BATCH_CLOSE == Operation->DOperation){
+                MachineReleaseReadAhead(Operation->DFileDescriptor);
+            }
+            if((MACHINE_BATCH_READ != Operation->DOperation) || !MachineReadBuffered(Operation->DFileDescriptor, Operation->DSegments, Operation->DCount, &Result)){
+                Result = MachineExecuteOperation(Operation);
+            }
+            MachineSendResult(Operation->DRequestID, Result);
+        }
+        for(; Index < End; Index++){
+            MachineFreeOperation(operations[Index]);
+        }
+    }
+    operations.clear();
+}
+
+// Returns a descriptor that becomes readable once the parent exits, so
+// the server loops can block indefinitely. Returns -1 if the kernel has no
+// pidfd_open, in which case the loops fall back to probing with kill().
+int MachineOpenParentFD(void){
+    int FileDescriptor = -1;
+    
+#if defined(__linux__) && defined(__NR_pidfd_open)
+    FileDescriptor = syscall(__NR_pidfd_open, MachineData.DParentPID, 0);
+    // The parent may have gone before the pidfd was taken
+    if((0 <= FileDescriptor) && (getppid() != MachineData.DParentPID)){
+        close(FileDescriptor);
+        FileDescriptor = -1;
+    }
+#endif
+    return FileDescriptor;
+}
+
+bool MachineParentAlive(void){
+    return (0 <= kill(MachineData.DParentPID, 0)) || (ESRCH != errno);
+}
+
+// Queues a read behind the others waiting on its descriptor, giving the
+// descriptor a pollfd slot if it is the first
+void MachinePollAddRead(std::vector< struct pollfd > &pollfds, std::map< int, size_t > &pollslots, std::map< int, std::deque< SMachinePendingRead > > &pendingreads, std::map< uint32_t, int > &readfds, const SMachinePendingRead &read){
+    std::deque< SMachinePendingRead > &Queue = pendingreads[read.DFileDescriptor];
+    
+    if(Queue.empty()){
+        struct pollfd NewReadFD;
+        
+        NewReadFD.fd = read.DFileDescriptor;
+        NewReadFD.events = POLLIN;
+        NewReadFD.revents = 0;
+        pollslots[read.DFileDescriptor] = pollfds.size();
+        pollfds.push_back(NewReadFD);
+    }
+    Queue.push_back(read);
+    readfds[read.DRequestID] = read.DFileDescriptor;
+}
+
+// Gives up the pollfd slot of a descriptor with no reads left, the last
+// slot moves into its place
+void MachinePollRemoveSlot(std::vector< struct pollfd > &pollfds, std::map< int, size_t > &pollslots, int fd){
+    auto SlotIter = pollslots.find(fd);
+    size_t Slot = SlotIter->second;
+    
+    pollslots.erase(SlotIter);
+    if(Slot + 1 != pollfds.size()){
+        pollfds[Slot] = pollfds.back();
+        pollslots[pollfds[Slot].fd] = Slot;
+    }
+    pollfds.pop_back();
+}
+
+void MachineServePoll(void){
+    bool Terminated = false;
+    std::vector< struct pollfd > PollFDs;
+    // Reads wait in order per descriptor, each descriptor with reads has
+    // one pollfd slot after the doorbell and parent
+    std::map< int, std::deque< SMachinePendingRead > > PendingReads;
+    std::map< int, size_t > PollSlots;
+    std::map< uint32_t, int > PendingReadFDs;
+    std::vector< SMachineOperationRef > InlineOperations;
+    SMachineRequest Request;
+    int Result, Count, Timeout;
+    struct iovec Segments[MACHINE_MAX_FILE_SEGMENTS];
+    uint64_t Doorbell;
+    
+    // The doorbell and parent pidfd come first, pending reads follow
+    PollFDs.resize(2);
+    PollFDs[0].fd = MachineData.DRequestDoorbell;
+    PollFDs[0].events = POLLIN;
+    PollFDs[0].revents = 0;
+    PollFDs[1].fd = MachineOpenParentFD();
+    PollFDs[1].events = POLLIN;
+    PollFDs[1].revents = 0;
+    if((0 > PollFDs[1].fd) && !MachineParentAlive()){
+        Terminated = true;
+    }
+    while(!Terminated){
+        SMachinePendingRead PendingRead;
+        
+        while(MachineReceiveRequest(&Request)){
+            // Inline requests queue up so adjacent ones can be merged, but
+            // run before anything that could depend on them
+            if((MACHINE_REQUEST_BATCH != Request.DHeader.DType) && (MACHINE_REQUEST_PREAD != Request.DHeader.DType) && (MACHINE_REQUEST_PWRITE != Request.DHeader.DType) && (MACHINE_REQUEST_SYNC != Request.DHeader.DType) && (MACHINE_REQUEST_DATASYNC != Request.DHeader.DType)){
+                MachineExecuteInline(InlineOperations);
+            }
+            switch(Request.DHeader.DType){
+                case MACHINE_REQUEST_NONE:          break;
+                case MACHINE_REQUEST_OPEN:          Request.DOpen.DFileName[PATH_MAX - 1] = '\0';
+                                                    MachineSendResult(Request.DHeader.DRequestID, open(Request.DOpen.DFileName, Request.DOpen.DFlags, Request.DOpen.DMode));
+                                                    break;
+                case MACHINE_REQUEST_READ:          PendingRead.DRequestID = Request.DHeader.DRequestID;
+                                                    PendingRead.DFileDescriptor = Request.DTransfer.DFileDescriptor;
+                                                    PendingRead.DCount = MachineGetSegments(&Request.DTransfer, PendingRead.DSegments);
+                                                    if((0 <= PendingRead.DCount) && !PollSlots.count(PendingRead.DFileDescriptor) && MachineReadBuffered(PendingRead.DFileDescriptor, PendingRead.DSegments, PendingRead.DCount, &Result)){
+                                                        MachineSendResult(PendingRead.DRequestID, Result);
+                                                    }
+                                                    else if(0 <= PendingRead.DCount){
+                                                        MachinePollAddRead(PollFDs, PollSlots, PendingReads, PendingReadFDs, PendingRead);
+                                                    }
+                                                    else{
+                                                        MachineSendResult(Request.DHeader.DRequestID, -1);
+                                                    }
+                                                    break;
+                case MACHINE_REQUEST_WRITE:         Count = MachineGetSegments(&Request.DTransfer, Segments);
+                                                    Result = -1;
+                                                    if(0 <= Count){
+                                                        MachineInvalidateReadAhead(Request.DTransfer.DFileDescriptor);
+                                                        do{
+                                                            Result = writev(Request.DTransfer.DFileDescriptor, Segments, Count);
+                                                        }while((-1 == Result) && (EINTR == errno));
+                                                    }
+                                                    MachineSendResult(Request.DHeader.DRequestID, Result);
+                                                    break;
+                case MACHINE_REQUEST_SEEK:          MachineSendResult(Request.DHeader.DRequestID, lseek(Request.DSeek.DFileDescriptor, Request.DSeek.DOffset, Request.DSeek.DWhence));
+                                                    break;
+                case MACHINE_REQUEST_CLOSE:         MachineReleaseReadAhead(Request.DClose.DFileDescriptor);
+                                                    MachineSendResult(Request.DHeader.DRequestID, close(Request.DClose.DFileDescriptor));
+                                                    break;
+                case MACHINE_REQUEST_BATCH:
+                case MACHINE_REQUEST_PREAD:
+                case MACHINE_REQUEST_PWRITE:
+                case MACHINE_REQUEST_SYNC:
+                case MACHINE_REQUEST_DATASYNC:      MachineDecodeRequest(&Request, InlineOperations);
+                                                    break;
+                case MACHINE_REQUEST_CANCEL:        if(PendingReadFDs.count(Request.DHeader.DRequestID)){
+                                                        int FileDescriptor = PendingReadFDs[Request.DHeader.DRequestID];
+                                                        std::deque< SMachinePendingRead > &Queue = PendingReads[FileDescriptor];
+                                                        
+                                                        for(auto ReadIter = Queue.begin(); ReadIter != Queue.end(); ReadIter++){
+                                                            if(ReadIter->DRequestID == Request.DHeader.DRequestID){
+                                                                Queue.erase(ReadIter);
+                                                                break;
+                                                            }
+                                                        }
+                                                        PendingReadFDs.erase(Request.DHeader.DRequestID);
+                                                        if(Queue.empty()){
+                                                            PendingReads.erase(FileDescriptor);
+                                                            MachinePollRemoveSlot(PollFDs, PollSlots, FileDescriptor);
+                                                        }
+                                                        MachineSendResult(Request.DHeader.DRequestID, MACHINE_FILE_CANCELLED);
+                                                    }
+                                                    break;
+                case MACHINE_REQUEST_TERMINATE:     Terminated = true;
+                default:                            break;
+            }
+        }
+        MachineExecuteInline(InlineOperations);
+        if(Terminated){
+            break;
+        }
+        Timeout = MachineConsoleService(false);
+        if((0 > PollFDs[1].fd) && ((0 > Timeout) || (MACHINE_PARENT_PROBE_MS < Timeout))){
+            Timeout = MACHINE_PARENT_PROBE_MS;
+        }
+        // Tell the parent to ring the doorbell, then make sure nothing
+        // slipped into the rings before it could see the flag
+        __atomic_store_n(&MachineData.DRings->DRequestSleeping, 1, __ATOMIC_SEQ_CST);
+        if((MachineData.DRings->DRequestHead != __atomic_load_n(&MachineData.DRings->DRequestTail, __ATOMIC_SEQ_CST)) || MachineConsoleChanged()){
+            __atomic_store_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        PollFDs[0].revents = 0;
+        PollFDs[1].revents = 0;
+        Result = poll(PollFDs.data(), PollFDs.size(), Timeout);
+        __atomic_store_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST);
+        if((0 < Result)&&(PollFDs[0].revents)){
+            read(PollFDs[0].fd, &Doorbell, sizeof(Doorbell));
+        }
+        if((0 < Result)&&(PollFDs[1].revents)){
+            Terminated = true;
+        }
+        else if((0 == Result)&&!MachineParentAlive()){
+            Terminated = true;
+        }
+        // Every ready descriptor gets one read per round. Going backwards
+        // means a slot moved in by a removal has already been looked at.
+        for(size_t Index = PollFDs.size() - 1; 2 <= Index; Index--){
+            int FileDescriptor = PollFDs[Index].fd;
+            
+            if(!PollFDs[Index].revents){
+                continue;
+            }
+            PollFDs[Index].revents = 0;
+            std::deque< SMachinePendingRead > &Queue = PendingReads[FileDescriptor];
+            
+            Result = MachineReadStream(FileDescriptor, Queue.front().DSegments, Queue.front().DCount);
+            MachineSendResult(Queue.front().DRequestID, Result);
+            PendingReadFDs.erase(Queue.front().DRequestID);
+            Queue.pop_front();
+            // Later reads on the descriptor take what is left over
+            while(!Queue.empty() && MachineReadBuffered(FileDescriptor, Queue.front().DSegments, Queue.front().DCount, &Result)){
+                MachineSendResult(Queue.front().DRequestID, Result);
+                PendingReadFDs.erase(Queue.front().DRequestID);
+                Queue.pop_front();
+            }
+            if(Queue.empty()){
+                PendingReads.erase(FileDescriptor);
+                MachinePollRemoveSlot(PollFDs, PollSlots, FileDescriptor);
+            }
+        }
+    }
+    if(0 <= PollFDs[1].fd){
+        close(PollFDs[1].fd);
+    }
+}
+
+// Reads wait for data or a cancel first, so one blocked on a terminal or
+// pipe can still be withdrawn
+int MachineWorkerExecute(SMachineOperationRef operation, int cancelfd){
+    if((MACHINE_BATCH_READ == operation->DOperation) || (MACHINE_BATCH_READ_AT == operation->DOperation)){
+        struct pollfd PollFDs[2];
+        
+        PollFDs[0].fd = operation->DFileDescriptor;
+        PollFDs[0].events = POLLIN;
+        PollFDs[1].fd = cancelfd;
+        PollFDs[1].events = POLLIN;
+        PollFDs[1].revents = 0;
+        while((0 > poll(PollFDs, 2, -1)) && (EINTR == errno));
+        if(PollFDs[1].revents){
+            return MACHINE_FILE_CANCELLED;
+        }
+    }
+    return MachineExecuteOperation(operation);
+}
+
+// Worker threads take the oldest operation for a descriptor no other
+// worker holds, so each descriptor stays in order while others proceed
+void *MachineWorkerThread(void *param){
+    SMachineWorkQueueRef WorkQueue = (SMachineWorkQueueRef)param;
+    std::vector< SMachineOperationRef > Group;
+    int CancelFD = eventfd(0, EFD_NONBLOCK);
+    uint64_t Cancels;
+    
+    pthread_mutex_lock(&WorkQueue->DMutex);
+    while(true){
+        SMachineOperationRef Operation;
+        int64_t Key;
+        int Result;
+        
+        while(WorkQueue->DReady.empty() && !WorkQueue->DTerminated){
+            pthread_cond_wait(&WorkQueue->DCondition, &WorkQueue->DMutex);
+        }
+        if(WorkQueue->DTerminated){
+            break;
+        }
+        Key = WorkQueue->DReady.front();
+        WorkQueue->DReady.pop_front();
+        // Syncs that queued up behind each other share one flush, the
+        // entries stay queued until it is done so the key is not reused
+        Group.assign(1, WorkQueue->DQueues[Key].front());
+        if(MachineIsSync(Group[0]->DOperation)){
+            std::deque< SMachineOperationRef > &Queue = WorkQueue->DQueues[Key];
+            
+            Group.assign(Queue.begin(), Queue.begin() + MachineSyncGroup(Queue));
+        }
+        Operation = Group[0];
+        // A cancel meant for the previous operation must not stop this one
+        read(CancelFD, &Cancels, sizeof(Cancels));
+        WorkQueue->DRunning[Key].DCount = Group.size();
+        WorkQueue->DRunning[Key].DCancelFD = CancelFD;
+        pthread_mutex_unlock(&WorkQueue->DMutex);
+        
+        Result = MachineWorkerExecute(Operation, CancelFD);
+        for(size_t Index = 0; Index < Group.size(); Index++){
+            MachineSendResult(Group[Index]->DRequestID, Result);
+            MachineFreeOperation(Group[Index]);
+        }
+        
+        pthread_mutex_lock(&WorkQueue->DMutex);
+        WorkQueue->DRunning.erase(Key);
+        std::deque< SMachineOperationRef > &Queue = WorkQueue->DQueues[Key];
+        Queue.erase(Queue.begin(), Queue.begin() + Group.size());
+        if(Queue.empty()){
+            WorkQueue->DQueues.erase(Key);
+        }
+        else{
+            WorkQueue->DReady.push_back(Key);
+        }
+    }
+    pthread_mutex_unlock(&WorkQueue->DMutex);
+    close(CancelFD);
+    return NULL;
+}
+
+// Drops an operation no worker has started on and interrupts a read a
+// worker is waiting on. Anything else a worker holds, such as the syncs
+// sharing a flush, completes normally.
+void MachineWorkersCancel(SMachineWorkQueueRef workqueue, uint32_t requestid){
+    pthread_mutex_lock(&workqueue->DMutex);
+    for(auto QueueIter = workqueue->DQueues.begin(); QueueIter != workqueue->DQueues.end(); QueueIter++){
+        std::deque< SMachineOperationRef > &Queue = QueueIter->second;
+        auto RunningIter = workqueue->DRunning.find(QueueIter->first);
+        size_t Held = (workqueue->DRunning.end() != RunningIter) ? RunningIter->second.DCount : 0;
+        
+        for(size_t Index = 0; Index < Queue.size(); Index++){
+            if(Queue[Index]->DRequestID != requestid){
+                continue;
+            }
+            if(Index < Held){
+                if(!Index && ((MACHINE_BATCH_READ == Queue[0]->DOperation) || (MACHINE_BATCH_READ_AT == Queue[0]->DOperation))){
+                    uint64_t Cancel = 1;
+                    
+                    write(RunningIter->second.DCancelFD, &Cancel, sizeof(Cancel));
+                }
+            }
+            else{
+                MachineSendResult(requestid, MACHINE_FILE_CANCELLED);
+                MachineFreeOperation(Queue[Index]);
+                Queue.erase(Queue.begin() + Index);
+                // A queue nobody holds is waiting in DReady
+                if(Queue.empty()){
+                    auto ReadyIter = std::find(workqueue->DReady.begin(), workqueue->DReady.end(), QueueIter->first);
+                    
+                    if(workqueue->DReady.end() != ReadyIter){
+                        workqueue->DReady.erase(ReadyIter);
+                    }
+                    workqueue->DQueues.erase(QueueIter);
+                }
+            }
+            pthread_mutex_unlock(&workqueue->DMutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&workqueue->DMutex);
+}
+
+// Child server loop that hands operations to a pool of worker threads.
+// Operations are keyed by descriptor, each open gets a key of its own.
+void MachineServeWorkers(void){
+    SMachineWorkQueue WorkQueue;
+    std::vector< SMachineOperationRef > Operations;
+    SMachineRequest Request;
+    struct pollfd PollFDs[2];
+    bool Terminated = false;
+    int64_t OpenKey = INT_MAX;
+    sigset_t AllSignals, OldSignals;
+    pthread_t Thread;
+    uint64_t Doorbell;
+    int Result, Timeout;
+    
+    pthread_mutex_init(&WorkQueue.DMutex, NULL);
+    pthread_cond_init(&WorkQueue.DCondition, NULL);
+    WorkQueue.DTerminated = false;
+    MachineReplyLocked = true;
+    // Workers should never take a signal meant for the server loop
+    sigfillset(&AllSignals);
+    pthread_sigmask(SIG_BLOCK, &AllSignals, &OldSignals);
+    for(int Index = 0; Index < MachineWorkerCount; Index++){
+        if(0 == pthread_create(&Thread, NULL, MachineWorkerThread, &WorkQueue)){
+            pthread_detach(Thread);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &OldSignals, NULL);
+    
+    PollFDs[0].fd = MachineData.DRequestDoorbell;
+    PollFDs[0].events = POLLIN;
+    PollFDs[1].fd = MachineOpenParentFD();
+    PollFDs[1].events = POLLIN;
+    if((0 > PollFDs[1].fd) && !MachineParentAlive()){
+        Terminated = true;
+    }
+    while(!Terminated){
+        while(MachineReceiveRequest(&Request)){
+            if(MACHINE_REQUEST_CANCEL == Request.DHeader.DType){
+                MachineWorkersCancel(&WorkQueue, Request.DHeader.DRequestID);
+                continue;
+            }
+            Operations.clear();
+            if(!MachineDecodeRequest(&Request, Operations)){
+                Terminated = true;
+                break;
+            }
+            pthread_mutex_lock(&WorkQueue.DMutex);
+            for(size_t Index = 0; Index < Operations.size(); Index++){
+                int64_t Key = Operations[Index]->DFileDescriptor;
+                
+                if(MACHINE_BATCH_OPEN == Operations[Index]->DOperation){
+                    Key = ++OpenKey;
+                }
+                std::deque< SMachineOperationRef > &Queue = WorkQueue.DQueues[Key];
+                Queue.push_back(Operations[Index]);
+                if(1 == Queue.size()){
+                    WorkQueue.DReady.push_back(Key);
+                    pthread_cond_signal(&WorkQueue.DCondition);
+                }
+            }
+            pthread_mutex_unlock(&WorkQueue.DMutex);
+        }
+        if(Terminated){
+            break;
+        }
+        Timeout = MachineConsoleService(false);
+        if((0 > PollFDs[1].fd) && ((0 > Timeout) || (MACHINE_PARENT_PROBE_MS < Timeout))){
+            Timeout = MACHINE_PARENT_PROBE_MS;
+        }
+        __atomic_store_n(&MachineData.DRings->DRequestSleeping, 1, __ATOMIC_SEQ_CST);
+        if((MachineData.DRings->DRequestHead != __atomic_load_n(&MachineData.DRings->DRequestTail, __ATOMIC_SEQ_CST)) || MachineConsoleChanged()){
+            __atomic_store_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        PollFDs[0].revents = 0;
+        PollFDs[1].revents = 0;
+        Result = poll(PollFDs, 2, Timeout);
+        __atomic_store_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST);
+        if((0 < Result)&&(PollFDs[0].revents)){
+            read(PollFDs[0].fd, &Doorbell, sizeof(Doorbell));
+        }
+        if((0 < Result)&&(PollFDs[1].revents)){
+            Terminated = true;
+        }
+        else if((0 == Result)&&!MachineParentAlive()){
+            Terminated = true;
+        }
+    }
+    if(0 <= PollFDs[1].fd){
+        close(PollFDs[1].fd);
+    }
+    // Workers blocked on a terminal read cannot be joined, the process
+    // exits right after this so they are only told to stop
+    pthread_mutex_lock(&WorkQueue.DMutex);
+    WorkQueue.DTerminated = true;
+    pthread_cond_broadcast(&WorkQueue.DCondition);
+    pthread_mutex_unlock(&WorkQueue.DMutex);
+}
+
+#ifdef __linux__
+bool MachineUringSetup(SMachineUringRef ring){
+    struct io_uring_params Params;
+    uint32_t Required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+    size_t CompleteSize;
+    
+    memset(&Params, 0, sizeof(Params));
+    ring->DFileDescriptor = syscall(__NR_io_uring_setup, MACHINE_URING_ENTRIES, &Params);
+    if(0 > ring->DFileDescriptor){
+        return false;
+    }
+    if(Required != (Params.features & Required)){
+        close(ring->DFileDescriptor);
+        return false;
+    }
+    // With IORING_FEAT_SINGLE_MMAP one mapping covers both rings
+    ring->DRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32_t);
+    CompleteSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+    if(CompleteSize > ring->DRingSize){
+        ring->DRingSize = CompleteSize;
+    }
+    ring->DRingBase = (uint8_t *)mmap(NULL, ring->DRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->DFileDescriptor, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == ring->DRingBase){
+        close(ring->DFileDescriptor);
+        return false;
+    }
+    ring->DEntriesSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->DSubmitEntries = (struct io_uring_sqe *)mmap(NULL, ring->DEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->DFileDescriptor, IORING_OFF_SQES);
+    if(MAP_FAILED == ring->DSubmitEntries){
+        munmap(ring->DRingBase, ring->DRingSize);
+        close(ring->DFileDescriptor);
+        return false;
+    }
+    ring->DSubmitHead = (uint32_t *)(ring->DRingBase + Params.sq_off.head);
+    ring->DSubmitTail = (uint32_t *)(ring->DRingBase + Params.sq_off.tail);
+    ring->DSubmitMask = *(uint32_t *)(ring->DRingBase + Params.sq_off.ring_mask);
+    ring->DSubmitCount = Params.sq_entries;
+    ring->DSubmitArray = (uint32_t *)(ring->DRingBase + Params.sq_off.array);
+    ring->DCompleteHead = (uint32_t *)(ring->DRingBase + Params.cq_off.head);
+    ring->DCompleteTail = (uint32_t *)(ring->DRingBase + Params.cq_off.tail);
+    ring->DCompleteMask = *(uint32_t *)(ring->DRingBase + Params.cq_off.ring_mask);
+    ring->DCompleteEntries = (struct io_uring_cqe *)(ring->DRingBase + Params.cq_off.cqes);
+    ring->DPendingSubmit = 0;
+    return true;
+}
 
-void MachineContextCreateTrampoline(int sig);
-void MachineContextCreateBoot(void);
+void MachineUringTeardown(SMachineUringRef ring){
+    munmap(ring->DSubmitEntries, ring->DEntriesSize);
+    munmap(ring->DRingBase, ring->DRingSize);
+    close(ring->DFileDescriptor);
+}
 
-void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
-    struct sigaction SigAction;
-    struct sigaction OldSigAction;
-    stack_t SigStack;
-    stack_t OldSigStack;
-    sigset_t OldSigSet;
-    sigset_t SigSet;
-    
-    // Step 1: 
-    sigemptyset(&SigSet);
-    sigaddset(&SigSet, SIGUSR1);
-    sigprocmask(SIG_BLOCK, &SigSet, &OldSigSet);
-    
-    // Step 2: 
-    memset((void *)&SigAction, 0, sizeof(struct sigaction));
-    SigAction.sa_handler = MachineContextCreateTrampoline;
-    SigAction.sa_flags = SA_ONSTACK;
-    sigemptyset(&SigAction.sa_mask);
-    sigaction(SIGUSR1, &SigAction, &OldSigAction);
+// Submits anything queued and, if wait is set, blocks for a completion
+int MachineUringEnter(SMachineUringRef ring, unsigned int wait){
+    int Result;
     
-    // Step 3: 
-    SigStack.ss_sp = stackaddr;
-    SigStack.ss_size = stacksize;
-    SigStack.ss_flags = 0;
-    sigaltstack(&SigStack, &OldSigStack);
-    
-    // Step 4: 
-    MachineContextCreateRef = mcntxref;
-    MachineContextCreateFunction = entry;
-    MachineContextCreateParam = param;
-    MachineContextCreateSignals = OldSigSet;
-    MachineContextCalled = false;
-    kill(getpid(), SIGUSR1);
-    sigfillset(&SigSet);
-    sigdelset(&SigSet, SIGUSR1);
-    while (!MachineContextCalled){
-        sigsuspend(&SigSet);
+    if(!ring->DPendingSubmit && !wait){
+        return 0;
     }
-    
-    // Step 6: 
-    sigaltstack(NULL, &SigStack);
-    SigStack.ss_flags = SS_DISABLE;
-    sigaltstack(&SigStack, NULL);
-    if(!(OldSigStack.ss_flags & SS_DISABLE)){
-        sigaltstack(&OldSigStack, NULL);
+    do{
+        Result = syscall(__NR_io_uring_enter, ring->DFileDescriptor, ring->DPendingSubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }while((0 > Result) && (EINTR == errno));
+    if(0 < Result){
+        ring->DPendingSubmit -= Result;
     }
-    sigaction(SIGUSR1, &OldSigAction, NULL);
-    sigprocmask(SIG_SETMASK, &OldSigSet, NULL);
-    
-    // Step 7 & Step 8: 
-    MachineContextSwitch(&MachineContextCaller, mcntxref);
-    
-    // Step 14: 
-    return;
+    return Result;
 }
 
-void MachineContextCreateTrampoline(int sig){
-    // Step 5: 
-    if(MachineContextSave(MachineContextCreateRef) == 0){
-        MachineContextCalled = true;
-        return;
-    }
+// Returns a cleared submission entry, MachineUringCommit queues it
+struct io_uring_sqe *MachineUringGetEntry(SMachineUringRef ring){
+    uint32_t Tail = *ring->DSubmitTail;
+    struct io_uring_sqe *Entry;
     
-    // Step 9: 
-    MachineContextCreateBoot();
+    while(ring->DSubmitCount <= Tail - __atomic_load_n(ring->DSubmitHead, __ATOMIC_ACQUIRE)){
+        MachineUringEnter(ring, 0);
+    }
+    Entry = &ring->DSubmitEntries[Tail & ring->DSubmitMask];
+    memset(Entry, 0, sizeof(struct io_uring_sqe));
+    ring->DSubmitArray[Tail & ring->DSubmitMask] = Tail & ring->DSubmitMask;
+    return Entry;
 }
 
-void MachineContextCreateBoot(void){
-    void (*MachineContextStartFunction)(void *);
-    void *MachineContextStartParam;
-    
-    // Step 10: 
-    sigprocmask(SIG_SETMASK, &MachineContextCreateSignals, NULL);
-    
-    // Step 11: 
-    MachineContextStartFunction = MachineContextCreateFunction;
-    MachineContextStartParam = MachineContextCreateParam;
-    
-    // Step 12 & Step 13: 
-    MachineContextSwitch(MachineContextCreateRef, &MachineContextCaller);
-    
-    // The thread "magically" starts... 
-    MachineContextStartFunction(MachineContextStartParam);
+void MachineUringCommit(SMachineUringRef ring){
+    __atomic_store_n(ring->DSubmitTail, *ring->DSubmitTail + 1, __ATOMIC_RELEASE);
+    ring->DPendingSubmit++;
+}
+
+void MachineUringPoll(SMachineUringRef ring, int fd, uint64_t userdata){
+    struct io_uring_sqe *Entry = MachineUringGetEntry(ring);
     
-    // NOTREACHED 
-    abort();
+    Entry->opcode = IORING_OP_POLL_ADD;
+    Entry->fd = fd;
+    Entry->poll32_events = POLLIN;
+    Entry->user_data = userdata;
+    MachineUringCommit(ring);
 }
 
-int MachineGetInt(uint8_t *ptr){
-    int Value = 0;
-    for(size_t Index = 0; Index < sizeof(int); Index++){
-        Value <<= 8;
-        Value |= ptr[Index];
-    }
-    return Value;
+void MachineUringTimeout(SMachineUringRef ring, struct __kernel_timespec *timeout, uint64_t userdata){
+    struct io_uring_sqe *Entry = MachineUringGetEntry(ring);
+    
+    Entry->opcode = IORING_OP_TIMEOUT;
+    Entry->fd = -1;
+    Entry->addr = (uint64_t)timeout;
+    Entry->len = 1;
+    Entry->user_data = userdata;
+    MachineUringCommit(ring);
 }
 
-uint8_t *MachineGetPointer(uint8_t *ptr){
-    uint8_t *Value = (uint8_t *)0;
-    uint8_t *Dest = (uint8_t *)&Value;
-    for(size_t Index = 0; Index < sizeof(uint8_t *); Index++){
-        Dest[Index] = ptr[Index];
+void MachineUringIssue(SMachineUringRef ring, SMachineOperationRef operation){
+    struct io_uring_sqe *Entry = MachineUringGetEntry(ring);
+    
+    switch(operation->DOperation){
+        case MACHINE_BATCH_OPEN:    Entry->opcode = IORING_OP_OPENAT;
+                                    Entry->fd = AT_FDCWD;
+                                    Entry->addr = (uint64_t)operation->DFileName;
+                                    Entry->len = operation->DArgument2;
+                                    Entry->open_flags = operation->DArgument1;
+                                    break;
+        case MACHINE_BATCH_READ:    Entry->opcode = IORING_OP_READV;
+                                    Entry->fd = operation->DFileDescriptor;
+                                    Entry->addr = (uint64_t)operation->DSegments;
+                                    Entry->len = operation->DCount;
+                                    Entry->off = (uint64_t)-1;
+                                    break;
+        case MACHINE_BATCH_WRITE:   Entry->opcode = IORING_OP_WRITEV;
+                                    Entry->fd = operation->DFileDescriptor;
+                                    Entry->addr = (uint64_t)operation->DSegments;
+                                    Entry->len = operation->DCount;
+                                    Entry->off = (uint64_t)-1;
+                                    break;
+        case MACHINE_BATCH_CLOSE:   Entry->opcode = IORING_OP_CLOSE;
+                                    Entry->fd = operation->DFileDescriptor;
+                                    break;
+        case MACHINE_BATCH_READ_AT: Entry->opcode = IORING_OP_READV;
+                                    Entry->fd = operation->DFileDescriptor;
+                                    Entry->addr = (uint64_t)operation->DSegments;
+                                    Entry->len = operation->DCount;
+                                    Entry->off = operation->DArgument1;
+                                    break;
+        case MACHINE_BATCH_WRITE_AT:Entry->opcode = IORING_OP_WRITEV;
+                                    Entry->fd = operation->DFileDescriptor;
+                                    Entry->addr = (uint64_t)operation->DSegments;
+                                    Entry->len = operation->DCount;
+                                    Entry->off = operation->DArgument1;
+                                    break;
+        case MACHINE_BATCH_SYNC:
+        case MACHINE_BATCH_DATASYNC:Entry->opcode = IORING_OP_FSYNC;
+                                    Entry->fd = operation->DFileDescriptor;
+                                    Entry->fsync_flags = MACHINE_BATCH_DATASYNC == operation->DOperation ? IORING_FSYNC_DATASYNC : 0;
+                                    break;
+        default:                    Entry->opcode = IORING_OP_NOP;
+                                    break;
     }
-    return Value;
+    Entry->user_data = (uint64_t)operation;
+    MachineUringCommit(ring);
 }
 
-void MachineSetInt(uint8_t *ptr, int val){
-    for(size_t Index = 0; Index < sizeof(int); Index++){
-        ptr[Index] = (val>>((sizeof(int) - Index - 1) * 8));
+// Operations on one descriptor run one at a time in arrival order since
+// reads and writes use the file position. Seeks have no io_uring opcode
+// and never block, so they are done here once they reach the front. A
+// sync answers the syncs queued right behind it, DArgument2 counts them.
+void MachineUringIssueNext(SMachineUringRef ring, std::deque< SMachineOperationRef > &queue){
+    while(!queue.empty()){
+        SMachineOperationRef Operation = queue.front();
+        
+        if(MACHINE_BATCH_SEEK != Operation->DOperation){
+            if(MachineIsSync(Operation->DOperation)){
+                Operation->DArgument2 = MachineSyncGroup(queue);
+            }
+            MachineUringIssue(ring, Operation);
+            break;
+        }
+        MachineSendResult(Operation->DRequestID, MachineExecuteOperation(Operation));
+        queue.pop_front();
+        MachineFreeOperation(Operation);
     }
 }
 
-void MachineSetPointer(uint8_t *ptr, uint8_t *val){
-    uint8_t *Source = (uint8_t *)&val;
-    for(size_t Index = 0; Index < sizeof(uint8_t *); Index++){
-        ptr[Index] = Source[Index];//(val>>((sizeof(int) - Index - 1) * 8));
+// Drops a queued operation, or asks the kernel to cancel a read that is
+// in flight. DArgument2 of the read notes the cancel so its completion is
+// reported as cancelled. A sync answered by the one in flight at the
+// front also leaves that sync's group count.
+void MachineUringCancel(SMachineUringRef ring, std::map< int, std::deque< SMachineOperationRef > > &filequeues, uint32_t requestid){
+    for(auto QueueIter = filequeues.begin(); QueueIter != filequeues.end(); QueueIter++){
+        std::deque< SMachineOperationRef > &Queue = QueueIter->second;
+        
+        for(size_t Index = 0; Index < Queue.size(); Index++){
+            SMachineOperationRef Operation = Queue[Index];
+            
+            if(Operation->DRequestID != requestid){
+                continue;
+            }
+            if(Index){
+                if(MachineIsSync(Queue.front()->DOperation) && ((int)Index < Queue.front()->DArgument2)){
+                    Queue.front()->DArgument2--;
+                }
+                MachineSendResult(requestid, MACHINE_FILE_CANCELLED);
+                MachineFreeOperation(Operation);
+                Queue.erase(Queue.begin() + Index);
+            }
+            else if(((MACHINE_BATCH_READ == Operation->DOperation) || (MACHINE_BATCH_READ_AT == Operation->DOperation)) && !Operation->DArgument2){
+                struct io_uring_sqe *Entry = MachineUringGetEntry(ring);
+                
+                Operation->DArgument2 = 1;
+                Entry->opcode = IORING_OP_ASYNC_CANCEL;
+                Entry->addr = (uint64_t)Operation;
+                Entry->user_data = MACHINE_URING_CANCEL;
+                MachineUringCommit(ring);
+            }
+            return;
+        }
     }
 }
 
-bool MachineValidSharePointer(uint8_t *ptr){
-    if(ptr < MachineData.DSharedBase){
-        return false;   
-    }
-    if(ptr >= (MachineData.DSharedBase + MachineData.DSharedSize)){
+// Child server loop that keeps operations on different descriptors in
+// flight together through io_uring. Returns false if io_uring is not
+// usable so the caller can fall back to the poll engine.
+bool MachineServeUring(void){
+    SMachineUring Ring;
+    std::map< int, std::deque< SMachineOperationRef > > FileQueues;
+    std::vector< SMachineOperationRef > Operations;
+    SMachineRequest Request;
+    struct __kernel_timespec Timeout, ConsoleTimeout;
+    bool Terminated = false, ConsoleTimerArmed = false;
+    uint64_t Doorbell;
+    int ParentFD, ConsoleWait;
+    
+    if(!MachineUringSetup(&Ring)){
+        fprintf(stderr,"io_uring unavailable, using poll engine\n");
         return false;
     }
-    return true;
-}
-
-void MachineRequestSignalHandler(int signum){
-    uint8_t TempByte = 0;
-    write(MachineSignalPipe[1],&TempByte, 1);
-}
-
-void MachineReplySignalHandler(int signum){
-    uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-    SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
-    ssize_t MessageSize;
-
-    do{
-        MessageSize = msgrcv(MachineData.DReplyChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
-        if(0 < MessageSize){
-            if(MachinePendingCallbacks.end() != MachinePendingCallbacks.find(MessageRef->DRequestID)){
-                SMachinePendingCallback Callinfo = MachinePendingCallbacks[MessageRef->DRequestID];
-                int ReturnValue = MachineGetInt(MessageRef->DPayload);
-                MachinePendingCallbacks.erase(MessageRef->DRequestID);
-                Callinfo.DCallback(Callinfo.DCalldata, ReturnValue);
+    Timeout.tv_sec = 0;
+    Timeout.tv_nsec = MACHINE_PARENT_PROBE_MS * 1000000;
+    MachineUringPoll(&Ring, MachineData.DRequestDoorbell, MACHINE_URING_DOORBELL);
+    ParentFD = MachineOpenParentFD();
+    if(0 <= ParentFD){
+        MachineUringPoll(&Ring, ParentFD, MACHINE_URING_PARENT);
+    }
+    else if(MachineParentAlive()){
+        MachineUringTimeout(&Ring, &Timeout, MACHINE_URING_TIMEOUT);
+    }
+    else{
+        Terminated = true;
+    }
+    while(!Terminated){
+        uint32_t Head;
+        
+        while(MachineReceiveRequest(&Request)){
+            if(MACHINE_REQUEST_CANCEL == Request.DHeader.DType){
+                MachineUringCancel(&Ring, FileQueues, Request.DHeader.DRequestID);
+                continue;
+            }
+            Operations.clear();
+            if(!MachineDecodeRequest(&Request, Operations)){
+                Terminated = true;
+                break;
+            }
+            for(size_t Index = 0; Index < Operations.size(); Index++){
+                if(MACHINE_BATCH_OPEN == Operations[Index]->DOperation){
+                    MachineUringIssue(&Ring, Operations[Index]);
+                }
+                else{
+                    std::deque< SMachineOperationRef > &Queue = FileQueues[Operations[Index]->DFileDescriptor];
+                    
+                    Queue.push_back(Operations[Index]);
+                    if(1 == Queue.size()){
+                        MachineUringIssueNext(&Ring, Queue);
+                    }
+                }
+            }
+        }
+        if(Terminated){
+            break;
+        }
+        ConsoleWait = MachineConsoleService(false);
+        if((0 <= ConsoleWait) && !ConsoleTimerArmed){
+            ConsoleTimeout.tv_sec = 0;
+            ConsoleTimeout.tv_nsec = ConsoleWait * 1000000LL;
+            MachineUringTimeout(&Ring, &ConsoleTimeout, MACHINE_URING_CONSOLE);
+            ConsoleTimerArmed = true;
+        }
+        __atomic_store_n(&MachineData.DRings->DRequestSleeping, 1, __ATOMIC_SEQ_CST);
+        if((MachineData.DRings->DRequestHead != __atomic_load_n(&MachineData.DRings->DRequestTail, __ATOMIC_SEQ_CST)) || MachineConsoleChanged()){
+            __atomic_store_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        MachineUringEnter(&Ring, 1);
+        __atomic_store_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST);
+        
+        Head = *Ring.DCompleteHead;
+        while(Head != __atomic_load_n(Ring.DCompleteTail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe *Completion = &Ring.DCompleteEntries[Head & Ring.DCompleteMask];
+            uint64_t UserData = Completion->user_data;
+            int Result = Completion->res;
+            
+            Head++;
+            __atomic_store_n(Ring.DCompleteHead, Head, __ATOMIC_RELEASE);
+            if(MACHINE_URING_DOORBELL == UserData){
+                read(MachineData.DRequestDoorbell, &Doorbell, sizeof(Doorbell));
+                MachineUringPoll(&Ring, MachineData.DRequestDoorbell, MACHINE_URING_DOORBELL);
+            }
+            else if(MACHINE_URING_PARENT == UserData){
+                Terminated = true;
+            }
+            else if(MACHINE_URING_CANCEL == UserData){
+                // The cancelled read completes on its own
+            }
+            else if(MACHINE_URING_CONSOLE == UserData){
+                ConsoleTimerArmed = false;
+            }
+            else if(MACHINE_URING_TIMEOUT == UserData){
+                if(!MachineParentAlive()){
+                    Terminated = true;
+                }
+                MachineUringTimeout(&Ring, &Timeout, MACHINE_URING_TIMEOUT);
             }
             else{
-                fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",MessageRef->DRequestID);
+                SMachineOperationRef Operation = (SMachineOperationRef)UserData;
+                
+                if(MACHINE_BATCH_OPEN != Operation->DOperation){
+                    int FileDescriptor = Operation->DFileDescriptor;
+                    std::deque< SMachineOperationRef > &Queue = FileQueues[FileDescriptor];
+                    int Completed = MachineIsSync(Operation->DOperation) ? Operation->DArgument2 : 1;
+                    int Reply = 0 > Result ? -1 : Result;
+                    
+                    if((0 > Result) && Operation->DArgument2 && !MachineIsSync(Operation->DOperation)){
+                        Reply = MACHINE_FILE_CANCELLED;
+                    }
+                    for(int Index = 0; Index < Completed; Index++){
+                        MachineSendResult(Queue.front()->DRequestID, Reply);
+                        MachineFreeOperation(Queue.front());
+                        Queue.pop_front();
+                    }
+                    MachineUringIssueNext(&Ring, Queue);
+                    if(Queue.empty()){
+                        FileQueues.erase(FileDescriptor);
+                    }
+                }
+                else{
+                    MachineSendResult(Operation->DRequestID, 0 > Result ? -1 : Result);
+                    MachineFreeOperation(Operation);
+                }
             }
         }
-    }while(0 < MessageSize);
-    
-    
+    }
+    // Closing the ring ends what is still in flight, then everything left
+    // queued is answered as cancelled and freed
+    MachineUringTeardown(&Ring);
+    for(auto QueueIter = FileQueues.begin(); QueueIter != FileQueues.end(); QueueIter++){
+        for(size_t Index = 0; Index < QueueIter->second.size(); Index++){
+            MachineSendResultNoWait(QueueIter->second[Index]->DRequestID, MACHINE_FILE_CANCELLED);
+            MachineFreeOperation(QueueIter->second[Index]);
+        }
+    }
+    FileQueues.clear();
+    if(0 <= ParentFD){
+        close(ParentFD);
+    }
+    return true;
+}
+#else
+bool MachineServeUring(void){
+    return false;
 }
+#endif
 
-uint32_t MachineAddRequest(TMachineFileCallback callback, void *calldata){
-    SMachinePendingCallback Callback;
+// Maps size bytes at an address that is a multiple of align, by reserving
+// align extra bytes and trimming the slack on either side.
+static void *MachineMapAligned(size_t size, size_t align, int flags, int fd){
+    uint8_t *Reserved;
+    uint8_t *Aligned;
+    size_t ReservedSize = size + align;
     
-    Callback.DCallback = callback;
-    Callback.DCalldata = calldata;
-    
-    MachineRequestID++;
-    MachinePendingCallbacks[(uint32_t)MachineRequestID] = Callback;
-    return MachineRequestID;
+    Reserved = (uint8_t *)mmap(NULL, ReservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(MAP_FAILED == Reserved){
+        return MAP_FAILED;
+    }
+    Aligned = (uint8_t *)(((uintptr_t)Reserved + (align - 1)) & ~((uintptr_t)align - 1));
+    if(MAP_FAILED == mmap(Aligned, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0)){
+        munmap(Reserved, ReservedSize);
+        return MAP_FAILED;
+    }
+    if(Aligned > Reserved){
+        munmap(Reserved, Aligned - Reserved);
+    }
+    if(Aligned + size < Reserved + ReservedSize){
+        munmap(Aligned + size, (Reserved + ReservedSize) - (Aligned + size));
+    }
+    return Aligned;
+}
+
+// Faults in a mapping after it has been advised, MAP_POPULATE would fault
+// it in before the advice could take effect.
+static void MachinePopulate(uint8_t *base, size_t size){
+#ifdef MADV_POPULATE_WRITE
+    if(0 == madvise(base, size, MADV_POPULATE_WRITE)){
+        return;
+    }
+#endif
+    for(size_t Index = 0; Index < size; Index += MACHINE_PAGE_SIZE){
+        ((volatile uint8_t *)base)[Index] = 0;
+    }
 }
 
-void MachineSendReply(SMachineRequestRef mess, int length){
-    msgsnd(MachineData.DReplyChannel, mess, length, 0);
-    kill(MachineData.DParentPID, SIGUSR2);
+// Sums the huge page backed bytes of the shared region from smaps, which
+// is the only place the kernel reports what a THP hint actually obtained.
+size_t MachineSharedHugePageSize(void){
+    FILE *SMapsFile;
+    char Line[256];
+    uintptr_t Start = (uintptr_t)MachineData.DSharedBase;
+    uintptr_t End = Start + MachineData.DMappedSize;
+    bool InRegion = false;
+    size_t Total = 0;
+    
+    if(!MachineInitialized){
+        return 0;
+    }
+    SMapsFile = fopen("/proc/self/smaps", "r");
+    if(NULL == SMapsFile){
+        return 0;
+    }
+    while(fgets(Line, sizeof(Line), SMapsFile)){
+        unsigned long MapStart, MapEnd, KiloBytes;
+        
+        if(2 == sscanf(Line, "%lx-%lx ", &MapStart, &MapEnd)){
+            InRegion = (MapStart < End) && (MapEnd > Start);
+        }
+        else if(InRegion && ((1 == sscanf(Line, "ShmemPmdMapped: %lu kB", &KiloBytes)) || (1 == sscanf(Line, "AnonHugePages: %lu kB", &KiloBytes)))){
+            Total += (size_t)KiloBytes * 1024;
+        }
+    }
+    fclose(SMapsFile);
+    return Total;
 }
 
 void *MachineInitialize(size_t sharesize){
     TMachineSignalState SigStateSave;
     struct sigaction OldSigAction, SigAction;
-    uint8_t TempPage[MACHINE_PAGE_SIZE];
-    int PageCount = ((sizeof(TempPage) - 1) + sharesize)/sizeof(TempPage);
+    int PageCount = ((MACHINE_PAGE_SIZE - 1) + sharesize)/MACHINE_PAGE_SIZE;
+    int RingPageCount = ((MACHINE_PAGE_SIZE - 1) + sizeof(SMachineRings))/MACHINE_PAGE_SIZE;
+    int MapFlags = MAP_SHARED;
     
     if(MachineInitialized){
         return NULL;
@@ -269,195 +2283,86 @@ void *MachineInitialize(size_t sharesize){
     
     sigaction(SIGALRM, NULL, &MachineAlarmActionSave);
     MachineData.DParentPID = getpid();
-    MachineData.DRequestChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if(0 > MachineData.DRequestChannel){
-        fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
+    MachineData.DRequestDoorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(0 > MachineData.DRequestDoorbell){
+        fprintf(stderr,"Failed to create request doorbell: %s\n", strerror(errno));
         exit(1);
     }
-    MachineData.DReplyChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if(0 > MachineData.DReplyChannel){
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
+    MachineData.DSharedSize = MACHINE_PAGE_SIZE * PageCount;
+    MachineData.DMappedSize = MACHINE_PAGE_SIZE * (PageCount + RingPageCount);
+    if(MachineHugePages){
+        // Whole huge pages, so the tail of the region is not left on small ones
+        MachineData.DMappedSize = ((MACHINE_HUGE_PAGE_SIZE - 1) + MachineData.DMappedSize) & ~((size_t)MACHINE_HUGE_PAGE_SIZE - 1);
+    }
+    // The region only has to be shared with the child, so it needs no name
+    // in the file system. A memfd is sized in one step and reads back as
+    // zeros, without memfd an anonymous shared mapping does the same.
+    MachineData.DMMapFile = -1;
+#ifdef MFD_CLOEXEC
+    MachineData.DMMapFile = memfd_create("vm_shmem", MFD_CLOEXEC);
+    if((0 <= MachineData.DMMapFile) && (0 > ftruncate(MachineData.DMMapFile, MachineData.DMappedSize))){
+        close(MachineData.DRequestDoorbell);
+        close(MachineData.DMMapFile);
+        fprintf(stderr,"Failed to size shared memory: %s\n", strerror(errno));
         exit(1);
     }
-    MachineData.DMMapFile = open("./vm_shmem", O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+#endif
     if(0 > MachineData.DMMapFile){
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to create shared memory file: %s\n", strerror(errno));
-        exit(1);
+        MapFlags |= MAP_ANONYMOUS;
     }
-    memset(TempPage,0,sizeof(TempPage));
-    for(int Index = 0; Index < PageCount; Index++){
-        write(MachineData.DMMapFile,TempPage,sizeof(TempPage));   
+    if(MachinePrefault && !MachineHugePages){
+        MapFlags |= MAP_POPULATE;
+    }
+    if(MachineHugePages){
+        MachineData.DSharedBase = (uint8_t *)MachineMapAligned(MachineData.DMappedSize, MACHINE_HUGE_PAGE_SIZE, MapFlags, MachineData.DMMapFile);
+    }
+    else{
+        MachineData.DSharedBase = (uint8_t *)mmap(NULL, MachineData.DMappedSize, PROT_READ | PROT_WRITE, MapFlags, MachineData.DMMapFile, 0);
     }
-    MachineData.DSharedSize = sizeof(TempPage) * PageCount;
-    MachineData.DSharedBase = (uint8_t *)mmap(NULL, MachineData.DSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, MachineData.DMMapFile, 0);
     if(MAP_FAILED == MachineData.DSharedBase){
-        close(MachineData.DMMapFile);
-        unlink("./vm_shmem");
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to map shared memory file: %s\n", strerror(errno));
+        if(0 <= MachineData.DMMapFile){
+            close(MachineData.DMMapFile);
+        }
+        close(MachineData.DRequestDoorbell);
+        fprintf(stderr,"Failed to map shared memory: %s\n", strerror(errno));
         exit(1);
     }
+    if(MachineHugePages){
+        // Only a hint, without THP for shared memory the region simply
+        // stays on normal pages
+        if(0 > madvise(MachineData.DSharedBase, MachineData.DMappedSize, MADV_HUGEPAGE)){
+            fprintf(stderr,"Huge pages unavailable, using normal pages: %s\n", strerror(errno));
+        }
+        if(MachinePrefault){
+            MachinePopulate(MachineData.DSharedBase, MachineData.DMappedSize);
+        }
+    }
+    MachineData.DRings = (SMachineRingsRef)(MachineData.DSharedBase + MachineData.DSharedSize);
+    // The forked child maps the region where the parent does, so one
+    // table serves both sides
+    MachineShareRegionCount = 0;
+    MachineAddShareRegion(MachineData.DSharedBase, MachineData.DSharedSize);
     
+    MachineInitializeCallbackSlots();
     
     MachineSuspendSignals(&SigStateSave);
     
     MachineData.DChildPID = fork();
     if(0 == MachineData.DChildPID){
-        bool Terminated = false;
-        std::vector< struct pollfd > PollFDs;
-        std::vector< SMachinePendingRead > PendingReads;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
-        ssize_t MessageSize;
-        sigset_t SigMask;
-        int Result, FileDescriptor, Length, Flags, Mode;
-        int Offset, Whence;
-        uint8_t *BufferPointer;
-        
         MachineData.DChildPID = getpid();
-        pipe(MachineSignalPipe);
-        PollFDs.resize(1);
-        PollFDs[0].fd = MachineSignalPipe[0];
-        PollFDs[0].events = POLLIN;
-        PollFDs[0].revents = 0;
-        memset((void *)&SigAction, 0, sizeof(struct sigaction));
-        SigAction.sa_handler = MachineRequestSignalHandler;
-        sigemptyset(&SigAction.sa_mask);
-        sigaction(SIGUSR2, &SigAction, &OldSigAction);
         MachineEnableSignals();
-        while(!Terminated){
-            sigemptyset(&SigMask);
-            PollFDs[0].events = POLLIN;
-            PollFDs[0].revents = 0;
-            Result = poll(PollFDs.data(), PollFDs.size(), 1);
-            if((0 < Result)&&(PollFDs[0].revents)){
-                SMachinePendingRead PendingRead;
-                bool Found;
-                uint8_t TempByte;
-
-                read(PollFDs[0].fd, &TempByte, 1);
-                while(true){
-                    MessageSize = msgrcv(MachineData.DRequestChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
-                    if(0 < MessageSize){
-                        switch(MessageRef->DType){
-                            case MACHINE_REQUEST_NONE:          break;
-                            case MACHINE_REQUEST_OPEN:          Flags = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + 1);
-                                                                Mode = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + sizeof(int) + 1);
-                                                                FileDescriptor = open((char *)MessageRef->DPayload, Flags, Mode);
-                                                                MachineSetInt(MessageRef->DPayload, FileDescriptor);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_READ:          PendingRead.DRequestID = MessageRef->DRequestID;
-                                                                PendingRead.DFileDescriptor = MachineGetInt(MessageRef->DPayload);
-                                                                PendingRead.DLength = MachineGetInt(MessageRef->DPayload + sizeof(int));
-                                                                PendingRead.DBuffer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
-                                                                if(MachineValidSharePointer(PendingRead.DBuffer) && (PendingRead.DLength <= MACHINE_MAX_TRANSFER_SIZE)){
-                                                                    Found = false;
-                                                                    for(size_t Index = 0; Index < PollFDs.size(); Index++){
-                                                                        if(PollFDs[Index].fd == PendingRead.DFileDescriptor){
-                                                                            Found = true;
-                                                                            break;
-                                                                        }
-                                                                    }
-                                                                    if(!Found){
-                                                                        struct pollfd NewReadFD;
-                                                                        
-                                                                        NewReadFD.fd = PendingRead.DFileDescriptor;
-                                                                        NewReadFD.events = POLLIN;
-                                                                        NewReadFD.revents = 0;
-                                                                        PollFDs.push_back(NewReadFD);
-                                                                    }
-                                                                    PendingReads.push_back(PendingRead);
-                                                                }
-                                                                else{
-                                                                    MachineSetInt(MessageRef->DPayload, -1);
-                                                                    MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1); 
-                                                                }
-                                                                break;
-                            case MACHINE_REQUEST_WRITE:         FileDescriptor = MachineGetInt(MessageRef->DPayload);
-                                                                Length = MachineGetInt(MessageRef->DPayload + sizeof(int));
-                                                                BufferPointer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
-                                                                if(MachineValidSharePointer(BufferPointer) && (Length <= MACHINE_MAX_TRANSFER_SIZE)){
-                                                                    do{
-                                                                        Result = write(FileDescriptor, BufferPointer, Length);
-                                                                    }while((-1 == Result) && (EINTR == errno));
-                                                                    MachineSetInt(MessageRef->DPayload, Result);
-                                                                }
-                                                                else{
-                                                                    MachineSetInt(MessageRef->DPayload, -1);
-                                                                }
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_SEEK:          FileDescriptor = MachineGetInt(MessageRef->DPayload);
-                                                                Offset = MachineGetInt(MessageRef->DPayload + sizeof(int));
-                                                                Whence = MachineGetInt(MessageRef->DPayload + sizeof(int) * 2);
-                                                                Offset = lseek(FileDescriptor, Offset, Whence);
-                                                                MachineSetInt(MessageRef->DPayload, Offset);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_CLOSE:         FileDescriptor = close(MachineGetInt(MessageRef->DPayload));
-                                                                MachineSetInt(MessageRef->DPayload, FileDescriptor);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
-                            case MACHINE_REQUEST_TERMINATE:     Terminated = true;
-                            default:                            break;
-                        }
-                    }
-                    else{
-                        break;   
-                    }   
-                }
-            }
-            else if(0 == Result){
-                if(0 > kill(MachineData.DParentPID, 0)){
-                    if(ESRCH == errno){
-                        Terminated = true;
-                    }
-                }
-            }
-            for(size_t Index = 1; Index < PollFDs.size(); Index++){
-                if(PollFDs[Index].revents){
-                    for(size_t ReadIndex = 0; ReadIndex < PendingReads.size(); ReadIndex++){
-                        if(PendingReads[ReadIndex].DFileDescriptor == PollFDs[Index].fd){
-                            do{
-                                Result = read(PendingReads[ReadIndex].DFileDescriptor, PendingReads[ReadIndex].DBuffer, PendingReads[ReadIndex].DLength);
-                            }while((-1 == Result) && (EINTR == errno));
-                            MessageRef->DRequestID = PendingReads[ReadIndex].DRequestID;
-                            MachineSetInt(MessageRef->DPayload, Result);
-                            MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                            PendingReads.erase(PendingReads.begin() + ReadIndex);
-                            break;
-                        }
-                    }
-                }
-            }
-            for(size_t Index = 1; Index < PollFDs.size();){
-                bool Found = false;
-                for(size_t ReadIndex = 0; ReadIndex < PendingReads.size(); ReadIndex++){
-                    if(PendingReads[ReadIndex].DFileDescriptor == PollFDs[Index].fd){
-                        Found = true;
-                    }
-                }
-                if(Found){
-                    Index++;
-                }
-                else{
-                    PollFDs.erase(PollFDs.begin() + Index);
-                }
-            }
+        if(MACHINE_ENGINE_WORKERS == MachineEngine){
+            MachineServeWorkers();
+        }
+        else if((MACHINE_ENGINE_URING != MachineEngine) || !MachineServeUring()){
+            MachineServePoll();
+        }
+        MachineConsoleService(true);
+        close(MachineData.DRequestDoorbell);
+        if(0 <= MachineData.DMMapFile){
+            close(MachineData.DMMapFile);
         }
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        close(MachineData.DMMapFile);
-        unlink("./vm_shmem");
-        sigaction(SIGUSR2, &OldSigAction, NULL);
         MachineResumeSignals(&SigStateSave);
-        close(MachineSignalPipe[0]);
-        close(MachineSignalPipe[1]);
         exit(0);
     }
     memset((void *)&SigAction, 0, sizeof(struct sigaction));
@@ -469,24 +2374,59 @@ void *MachineInitialize(size_t sharesize){
     return MachineData.DSharedBase;
 }
 
+void MachineSetEngine(int engine){
+    if(!MachineInitialized){
+        MachineEngine = engine;
+    }
+}
+
+void MachineSetPrefault(int prefault){
+    if(!MachineInitialized){
+        MachinePrefault = prefault;
+    }
+}
+
+void MachineSetHugePages(int hugepages){
+    if(!MachineInitialized){
+        MachineHugePages = hugepages;
+    }
+}
+
+void MachineSetWorkerCount(int count){
+    if(!MachineInitialized && (0 < count)){
+        MachineWorkerCount = count;
+    }
+}
+
 void MachineTerminate(void){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineRequestHeader Request;
         int Status;
         
         MachineSuspendSignals(&SignalState);
         
         sigaction(SIGALRM, &MachineAlarmActionSave, NULL);
         
-        MessageRef->DType = MACHINE_REQUEST_TERMINATE;
+        if(MachineLatencyReport){
+            MachineReportLatency(STDERR_FILENO);
+        }
+        if(MachineHugePages){
+            fprintf(stderr,"Shared memory huge pages: %zu of %zu KiB\n", MachineSharedHugePageSize() / 1024, MachineData.DMappedSize / 1024);
+        }
+        Request.DType = MACHINE_REQUEST_TERMINATE;
         ualarm(0,0);
-        MessageRef->DRequestID = MachineAddRequest(NULL, NULL);
-        close(MachineData.DMMapFile);
-        Status = msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        if(MachineAlarmTimerCreated){
+            timer_delete(MachineAlarmTimer);
+            MachineAlarmTimerCreated = false;
+        }
+        Request.DRequestID = MachineAddRequest(NULL, NULL);
+        if(0 <= MachineData.DMMapFile){
+            close(MachineData.DMMapFile);
+        }
+        MachineSendRequest((SMachineRequestRef)&Request, sizeof(Request));
         wait(&Status);
+        close(MachineData.DRequestDoorbell);
         MachineResumeSignals(&SignalState);
     }
     
@@ -533,96 +2473,330 @@ void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *
     }
 }
 
+// Fires the alarm callback once, usec from now, instead of periodically.
+// The first call stops the periodic alarm, 0 disarms the timer.
+void MachineProgramAlarm(useconds_t usec){
+    struct itimerspec Expiry;
+    
+    if(!MachineInitialized){
+        return;
+    }
+    if(!MachineAlarmTimerCreated){
+        struct sigevent Event;
+        
+        memset((void *)&Event, 0, sizeof(struct sigevent));
+        Event.sigev_notify = SIGEV_SIGNAL;
+        Event.sigev_signo = SIGALRM;
+        if(0 > timer_create(CLOCK_MONOTONIC, &Event, &MachineAlarmTimer)){
+            fprintf(stderr,"Failed to create alarm timer: %s\n", strerror(errno));
+            return;
+        }
+        MachineAlarmTimerCreated = true;
+        ualarm(0,0);
+    }
+    memset((void *)&Expiry, 0, sizeof(struct itimerspec));
+    Expiry.it_value.tv_sec = usec / 1000000;
+    Expiry.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timer_settime(MachineAlarmTimer, 0, &Expiry, NULL);
+}
+
+// Blocks with every signal unmasked until a handler has run
+void MachineWaitSignal(void){
+    sigset_t EmptySet;
+    
+    sigemptyset(&EmptySet);
+    sigsuspend(&EmptySet);
+}
+
+void MachineRequestReplyCallback(TMachineReplyCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    
+    MachineSuspendSignals(&SignalState);
+    MachineReplyCallback = callback;
+    MachineReplyCalldata = calldata;
+    MachineResumeSignals(&SignalState);
+}
+
 void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineOpenRequest Request;
+        size_t NameLength = strlen(filename);
         
-        MessageRef->DType = MACHINE_REQUEST_OPEN;
-        strcpy((char *)MessageRef->DPayload, filename);
-        MachineSetInt(MessageRef->DPayload + strlen(filename) + 1, flags);
-        MachineSetInt(MessageRef->DPayload + strlen(filename) + sizeof(int) + 1, mode);
+        // Too long for a ring slot, send an empty name so open(2) fails
+        if(PATH_MAX <= NameLength){
+            NameLength = 0;
+        }
+        Request.DHeader.DType = MACHINE_REQUEST_OPEN;
+        Request.DFlags = flags;
+        Request.DMode = mode;
+        memcpy(Request.DFileName, filename, NameLength);
+        Request.DFileName[NameLength] = '\0';
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + strlen(filename) + sizeof(int), 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineBeginRequest(&SignalState);
+        Request.DHeader.DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest((SMachineRequestRef)&Request, offsetof(SMachineOpenRequest, DFileName) + NameLength + 1);
+        MachineEndRequest(&SignalState);
     }
 }
 
 void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    SMachineFileSegment Segment;
+    
+    Segment.DData = data;
+    Segment.DLength = length;
+    MachineFileReadV(fd, &Segment, 1, callback, calldata);
+}
+
+void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    SMachineFileSegment Segment;
+    
+    Segment.DData = data;
+    Segment.DLength = length;
+    MachineFileWriteV(fd, &Segment, 1, callback, calldata);
+}
+
+void MachineFileReadAt(int fd, void *data, int length, int offset, TMachineFileCallback callback, void *calldata){
+    SMachineFileSegment Segment;
+    
+    Segment.DData = data;
+    Segment.DLength = length;
+    MachineFileReadAtV(fd, &Segment, 1, offset, callback, calldata);
+}
+
+void MachineFileWriteAt(int fd, void *data, int length, int offset, TMachineFileCallback callback, void *calldata){
+    SMachineFileSegment Segment;
+    
+    Segment.DData = data;
+    Segment.DLength = length;
+    MachineFileWriteAtV(fd, &Segment, 1, offset, callback, calldata);
+}
+
+void MachineFileTransfer(int type, int fd, SMachineFileSegmentRef segments, int count, int offset, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineTransferRequest Request;
+        size_t Length;
         
-        MessageRef->DType = MACHINE_REQUEST_READ;
-        MachineSetInt(MessageRef->DPayload, fd);
-        MachineSetInt(MessageRef->DPayload + sizeof(int), length);
-        MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
+        if((0 > count) || (MACHINE_MAX_FILE_SEGMENTS < count)){
+            count = -1;
+        }
+        Request.DHeader.DType = type;
+        Length = MachineSetSegments(&Request, fd, segments, count, offset);
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineBeginRequest(&SignalState);
+        Request.DHeader.DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest((SMachineRequestRef)&Request, Length);
+        MachineEndRequest(&SignalState);
     }
 }
 
-void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+void MachineFileReadV(int fd, SMachineFileSegmentRef segments, int count, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_READ, fd, segments, count, 0, callback, calldata);
+}
+
+void MachineFileWriteV(int fd, SMachineFileSegmentRef segments, int count, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_WRITE, fd, segments, count, 0, callback, calldata);
+}
+
+void MachineFileReadAtV(int fd, SMachineFileSegmentRef segments, int count, int offset, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_PREAD, fd, segments, count, offset, callback, calldata);
+}
+
+void MachineFileWriteAtV(int fd, SMachineFileSegmentRef segments, int count, int offset, TMachineFileCallback callback, void *calldata){
+    MachineFileTransfer(MACHINE_REQUEST_PWRITE, fd, segments, count, offset, callback, calldata);
+}
+
+void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSeekRequest Request;
         
-        MessageRef->DType = MACHINE_REQUEST_WRITE;
-        MachineSetInt(MessageRef->DPayload, fd);
-        MachineSetInt(MessageRef->DPayload + sizeof(int), length);
-        MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
+        Request.DHeader.DType = MACHINE_REQUEST_SEEK;
+        Request.DFileDescriptor = fd;
+        Request.DOffset = offset;
+        Request.DWhence = whence;
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineBeginRequest(&SignalState);
+        Request.DHeader.DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest((SMachineRequestRef)&Request, sizeof(Request));
+        MachineEndRequest(&SignalState);
     }
 }
 
-void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata){
+void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineCloseRequest Request;
         
-        MessageRef->DType = MACHINE_REQUEST_SEEK;
-        MachineSetInt(MessageRef->DPayload, fd);
-        MachineSetInt(MessageRef->DPayload + sizeof(int), offset);
-        MachineSetInt(MessageRef->DPayload + sizeof(int) * 2, whence);
+        Request.DHeader.DType = MACHINE_REQUEST_CLOSE;
+        Request.DFileDescriptor = fd;
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 3 * sizeof(int) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineBeginRequest(&SignalState);
+        Request.DHeader.DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest((SMachineRequestRef)&Request, sizeof(Request));
+        MachineEndRequest(&SignalState);
     }
 }
 
-void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata){
+void MachineFileFlush(int type, int fd, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
         TMachineSignalState SignalState;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        SMachineSyncRequest Request;
         
-        MessageRef->DType = MACHINE_REQUEST_CLOSE;
-        MachineSetInt(MessageRef->DPayload, fd);
+        Request.DHeader.DType = type;
+        Request.DFileDescriptor = fd;
         
-        MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + sizeof(int) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
-        MachineResumeSignals(&SignalState);
+        MachineBeginRequest(&SignalState);
+        Request.DHeader.DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest((SMachineRequestRef)&Request, sizeof(Request));
+        MachineEndRequest(&SignalState);
+    }
+}
+
+void MachineFileSync(int fd, TMachineFileCallback callback, void *calldata){
+    MachineFileFlush(MACHINE_REQUEST_SYNC, fd, callback, calldata);
+}
+
+void MachineFileDataSync(int fd, TMachineFileCallback callback, void *calldata){
+    MachineFileFlush(MACHINE_REQUEST_DATASYNC, fd, callback, calldata);
+}
+
+int MachineConsoleWrite(int fd, const void *data, int length){
+    TMachineSignalState SignalState;
+    SMachineConsoleRingRef Console;
+    uint32_t Head, Tail, Start;
+    uint64_t Doorbell = 1;
+    int Count;
+    bool Wake;
+    
+    if(!MachineInitialized || ((STDOUT_FILENO != fd) && (STDERR_FILENO != fd)) || (0 > length)){
+        return -1;
+    }
+    Console = &MachineData.DRings->DConsoles[fd - STDOUT_FILENO];
+    MachineBeginRequest(&SignalState);
+    Tail = Console->DTail;
+    Head = __atomic_load_n(&Console->DHead, __ATOMIC_ACQUIRE);
+    Count = MACHINE_CONSOLE_RING_SIZE - (Tail - Head);
+    if(length < Count){
+        Count = length;
+    }
+    Start = Tail % MACHINE_CONSOLE_RING_SIZE;
+    if(MACHINE_CONSOLE_RING_SIZE < Start + Count){
+        memcpy(Console->DData + Start, data, MACHINE_CONSOLE_RING_SIZE - Start);
+        memcpy(Console->DData, (const uint8_t *)data + MACHINE_CONSOLE_RING_SIZE - Start, Count - (MACHINE_CONSOLE_RING_SIZE - Start));
+    }
+    else{
+        memcpy(Console->DData + Start, data, Count);
+    }
+    __atomic_store_n(&Console->DTail, Tail + Count, __ATOMIC_SEQ_CST);
+    // A partial line behind others is written by its deadline, which the
+    // child is already waiting on
+    Wake = (Head == Tail) || (Count < length) || (MACHINE_CONSOLE_RING_SIZE / 2 <= Tail + Count - Head) || (NULL != memchr(data, '\n', Count));
+    if(Wake && __atomic_exchange_n(&MachineData.DRings->DRequestSleeping, 0, __ATOMIC_SEQ_CST)){
+        write(MachineData.DRequestDoorbell, &Doorbell, sizeof(Doorbell));
+    }
+    MachineEndRequest(&SignalState);
+    return Count;
+}
+
+int MachineFileCancel(TMachineFileCallback callback, void *calldata){
+    int Count = 0;
+    
+    if(MachineInitialized){
+        TMachineSignalState SignalState;
+        SMachineRequestHeader Request;
+        
+        Request.DType = MACHINE_REQUEST_CANCEL;
+        MachineBeginRequest(&SignalState);
+        for(int Index = 0; Index < MACHINE_MAX_PENDING_CALLBACKS; Index++){
+            SMachinePendingCallbackRef Slot = &MachinePendingCallbacks[Index];
+            
+            if(Slot->DInUse && (NULL == Slot->DBatchEntry) && (callback == Slot->DCallback) && (calldata == Slot->DCalldata)){
+                Request.DRequestID = Slot->DRequestID;
+                MachineSendRequest((SMachineRequestRef)&Request, sizeof(Request));
+                Count++;
+            }
+        }
+        MachineEndRequest(&SignalState);
+    }
+    return Count;
+}
+
+void MachineSubmitBatch(SMachineBatchEntryRef entries, int count, TMachineFileCallback callback, void *calldata){
+    if(MachineInitialized && (0 < count)){
+        TMachineSignalState SignalState;
+        SMachineBatchRequest Request;
+        SMachineBatchGroupRef Group = NULL;
+        
+        MachineBeginRequest(&SignalState);
+        for(int Index = 0; Index < MACHINE_MAX_BATCH_GROUPS; Index++){
+            if((0 == MachineBatchGroups[Index].DRemaining) && (NULL == MachineBatchGroups[Index].DCallback)){
+                Group = &MachineBatchGroups[Index];
+                break;
+            }
+        }
+        if(NULL == Group){
+            MachineEndRequest(&SignalState);
+            fprintf(stderr,"Too many outstanding Machine batches\n");
+            return;
+        }
+        Group->DCallback = callback;
+        Group->DCalldata = calldata;
+        Group->DRemaining = count;
+        Group->DFailed = false;
+        
+        // Pack as many operations as fit in each message; a batch only
+        // spans several messages if it outgrows a ring slot
+        Request.DHeader.DType = MACHINE_REQUEST_BATCH;
+        Request.DCount = 0;
+        Request.DNamesLength = 0;
+        for(int Index = 0; Index < count; Index++){
+            SMachineBatchRequestEntryRef Entry;
+            size_t NameLength = 0;
+            
+            if(MACHINE_BATCH_OPEN == entries[Index].DOperation){
+                NameLength = strlen(entries[Index].DFileName);
+                if(PATH_MAX <= NameLength){
+                    NameLength = 0;
+                }
+                NameLength++;
+            }
+            if((MACHINE_MAX_BATCH_REQUEST_ENTRIES == Request.DCount) || (PATH_MAX < Request.DNamesLength + NameLength)){
+                MachineSendRequest((SMachineRequestRef)&Request, offsetof(SMachineBatchRequest, DNames) + Request.DNamesLength);
+                Request.DCount = 0;
+                Request.DNamesLength = 0;
+            }
+            Entry = &Request.DEntries[Request.DCount++];
+            Entry->DOperation = entries[Index].DOperation;
+            Entry->DRequestID = MachineAddBatchRequest(&entries[Index], Group);
+            Entry->DFileDescriptor = entries[Index].DFileDescriptor;
+            if(MACHINE_BATCH_SEEK == entries[Index].DOperation){
+                Entry->DArgument1 = entries[Index].DOffset;
+                Entry->DArgument2 = entries[Index].DFlags;
+            }
+            else if((MACHINE_BATCH_READ_AT == entries[Index].DOperation) || (MACHINE_BATCH_WRITE_AT == entries[Index].DOperation)){
+                Entry->DArgument1 = entries[Index].DOffset;
+                Entry->DArgument2 = 0;
+            }
+            else if(MACHINE_BATCH_OPEN == entries[Index].DOperation){
+                Entry->DArgument1 = entries[Index].DFlags;
+                Entry->DArgument2 = entries[Index].DMode;
+            }
+            else{
+                Entry->DArgument1 = entries[Index].DFlags;
+                Entry->DArgument2 = 0;
+            }
+            MachineSetReference(&Entry->DData, entries[Index].DData, entries[Index].DLength);
+            Entry->DNameOffset = Request.DNamesLength;
+            if(NameLength){
+                memcpy(Request.DNames + Request.DNamesLength, entries[Index].DFileName, NameLength - 1);
+                Request.DNames[Request.DNamesLength + NameLength - 1] = '\0';
+                Request.DNamesLength += NameLength;
+            }
+        }
+        MachineSendRequest((SMachineRequestRef)&Request, offsetof(SMachineBatchRequest, DNames) + Request.DNamesLength);
+        MachineEndRequest(&SignalState);
     }
 }
 
@@ -10,6 +10,21 @@ extern "C" {
 #include <unistd.h>
 #include <stdint.h>
 
+// x86-64 switches contexts in assembly, saving only what a call has to
+// preserve. Defining MACHINE_CONTEXT_SETJMP keeps the portable version.
+#if defined(__x86_64__) && defined(__ELF__) && !defined(MACHINE_CONTEXT_SETJMP)
+#define MACHINE_CONTEXT_ASM
+
+typedef struct{
+    void *DStackPointer;
+} SMachineContext, *SMachineContextRef;
+
+void MachineContextSwitchAsm(SMachineContextRef mcntxold, SMachineContextRef mcntxnew);
+
+// switch machine context 
+#define MachineContextSwitch(mcntxold,mcntxnew)    \
+    MachineContextSwitchAsm((mcntxold), (mcntxnew))
+#else
 typedef struct{
     jmp_buf DJumpBuffer;
 } SMachineContext, *SMachineContextRef;
@@ -25,24 +40,104 @@ typedef struct{
 // switch machine context 
 #define MachineContextSwitch(mcntxold,mcntxnew)    \
     if(setjmp((mcntxold)->DJumpBuffer) == 0) longjmp((mcntxnew)->DJumpBuffer, 1)
+#endif
 
 // create machine context 
 void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize);
 
+#define MACHINE_MAX_FILE_SEGMENTS   64
+
+typedef struct{
+    void *DData;
+    int DLength;
+} SMachineFileSegment, *SMachineFileSegmentRef;
+
+#define MACHINE_ENGINE_POLL         0
+#define MACHINE_ENGINE_URING        1
+#define MACHINE_ENGINE_WORKERS      2
+
+#define MACHINE_DEFAULT_WORKERS     4
+
+#define MACHINE_BATCH_OPEN          0
+#define MACHINE_BATCH_READ          1
+#define MACHINE_BATCH_WRITE         2
+#define MACHINE_BATCH_SEEK          3
+#define MACHINE_BATCH_CLOSE         4
+#define MACHINE_BATCH_READ_AT       5
+#define MACHINE_BATCH_WRITE_AT      6
+#define MACHINE_BATCH_SYNC          7
+#define MACHINE_BATCH_DATASYNC      8
+
+// Result passed to a file callback whose request was cancelled
+#define MACHINE_FILE_CANCELLED      (-2)
+
 typedef void (*TMachineAlarmCallback)(void *calldata);
 typedef void (*TMachineFileCallback)(void *calldata, int result);
+typedef void (*TMachineReplyCallback)(void *calldata);
+
+// One operation of a batch; DFlags is the open flags or the seek whence,
+// DOffset is the seek offset or the position of a READ_AT or WRITE_AT.
+// DResult is filled in before DCallback (if any) is called.
+typedef struct{
+    int DOperation;
+    int DFileDescriptor;
+    const char *DFileName;
+    int DFlags;
+    int DMode;
+    int DOffset;
+    void *DData;
+    int DLength;
+    TMachineFileCallback DCallback;
+    void *DCalldata;
+    int DResult;
+} SMachineBatchEntry, *SMachineBatchEntryRef;
 typedef sigset_t TMachineSignalState, *TMachineSignalStateRef;
+void MachineSetEngine(int engine);
+void MachineSetWorkerCount(int count);
+void MachineSetPrefault(int prefault);
+void MachineSetHugePages(int hugepages);
+size_t MachineSharedHugePageSize(void);
 void *MachineInitialize(size_t sharesize);
 void MachineTerminate(void);
 void MachineEnableSignals(void);
 void MachineSuspendSignals(TMachineSignalStateRef sigstate);
 void MachineResumeSignals(TMachineSignalStateRef sigstate);
 void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *calldata);
+void MachineProgramAlarm(useconds_t usec);
+void MachineWaitSignal(void);
+// With a reply callback set, SIGUSR2 only calls it and the file callbacks
+// run from MachineProcessReplies. Requests then leave the signal mask
+// alone, so they must not be made from a handler that interrupted one.
+void MachineRequestReplyCallback(TMachineReplyCallback callback, void *calldata);
+int MachineProcessReplies(void);
+// Per request type latency histograms, printed to fd on demand or at
+// MachineTerminate once requested
+void MachineReportLatency(int fd);
+void MachineSetLatencyReport(int report);
 void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata);
 void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
 void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
+void MachineFileReadV(int fd, SMachineFileSegmentRef segments, int count, TMachineFileCallback callback, void *calldata);
+void MachineFileWriteV(int fd, SMachineFileSegmentRef segments, int count, TMachineFileCallback callback, void *calldata);
+void MachineFileReadAt(int fd, void *data, int length, int offset, TMachineFileCallback callback, void *calldata);
+void MachineFileWriteAt(int fd, void *data, int length, int offset, TMachineFileCallback callback, void *calldata);
+void MachineFileReadAtV(int fd, SMachineFileSegmentRef segments, int count, int offset, TMachineFileCallback callback, void *calldata);
+void MachineFileWriteAtV(int fd, SMachineFileSegmentRef segments, int count, int offset, TMachineFileCallback callback, void *calldata);
 void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata);
 void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata);
+// Syncs of one descriptor that are waiting together share a single flush
+void MachineFileSync(int fd, TMachineFileCallback callback, void *calldata);
+void MachineFileDataSync(int fd, TMachineFileCallback callback, void *calldata);
+// Withdraws the requests waiting to call callback with calldata, returns
+// how many were asked to stop. Reads still waiting for data and requests
+// the child has not started on complete with MACHINE_FILE_CANCELLED, any
+// other request completes normally.
+int MachineFileCancel(TMachineFileCallback callback, void *calldata);
+// Buffers output for STDOUT_FILENO or STDERR_FILENO without waiting for it
+// to be written, returns how many bytes fit (0 while the buffer is full)
+// or -1. It goes out in order with writes requested after it.
+int MachineConsoleWrite(int fd, const void *data, int length);
+void MachineSubmitBatch(SMachineBatchEntryRef entries, int count, TMachineFileCallback callback, void *calldata);
 
 
 #ifdef __cplusplus
@@ -3,9 +3,14 @@
 #include <unistd.h>
 #include <vector>
 #include <queue>
+#include <map>
+#include <algorithm>
 #include <cstring>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include <iostream>
 #include <iomanip>
@@ -16,7 +21,19 @@ void VMUnloadModule(void);
 TVMStatus VMDateTime(SVMDateTimeRef curdatetime);
 void ArrayCopy(const uint8_t* src, uint8_t* dest, int index, int len);
 TVMStatus FileSeek(int filedescriptor, int offset, int whence, int *newoffset);
+TVMStatus FileSync(int filedescriptor, bool dataOnly);
 TVMStatus FileRead(int filedescriptor, void *data, int *length);
+TVMStatus FileReadAt(int filedescriptor, int offset, void *data, int *length);
+TVMStatus FileReadTimed(int filedescriptor, int offset, void *data, int *length, TVMTick timeout);
+TVMStatus FileWriteAt(int filedescriptor, int offset, void *data, int *length);
+int FileTransferShared(bool write, int filedescriptor, int offset, void *data, int length);
+TVMStatus FATRead(int offset, void *data, int *length);
+TVMStatus FATWrite(int offset, void *data, int *length);
+void FATSync();
+void threadSchedule(int scheduleType);
+void SchedulerLock();
+void SchedulerUnlock();
+void FileCallback(void* calldata, int result);
 void VMStringCopy(char *dest, const char *src);
 void VMStringCopyN(char *dest, const char *src, int32_t n);
 TVMStatus VMDateTime(SVMDateTimeRef curdatetime);
@@ -33,6 +50,7 @@ struct Thread{
     void *stackAdr;
     size_t stackSize;
     TVMTick timeup;
+    TVMTick fileTimeup;
     int fileResult;
 };
 
@@ -50,6 +68,8 @@ struct TCBCompareTimeup {
 
 struct SharedMem{
     std::vector<void*> memChunks;
+    std::map<void*, int> lentChunks; // start of a lent run -> chunk count
+    int takeLimit; // most chunks one request may hold
 
     void Initialize(void* baseAdr, TVMMemorySize size){
         int i = 0;
@@ -58,6 +78,10 @@ struct SharedMem{
             size -= 512;
             i++;
         }
+        //A quarter of the pool so one large request cannot starve the rest
+        takeLimit = (i / 4 > 0) ? i / 4 : 1;
+        if(takeLimit > MACHINE_MAX_FILE_SEGMENTS)
+            takeLimit = MACHINE_MAX_FILE_SEGMENTS;
     }
 };
 
@@ -186,7 +210,14 @@ struct FATFile {
 //=============================================================
 volatile unsigned int g_tick;
 unsigned int tickMS;
-TMachineSignalState sigState;
+// Tickless mode derives g_tick from the clock and only programs the alarm
+// for the earliest sleeper, armedTick is the deadline it is set for
+bool tickless = false;
+struct timespec startTime;
+unsigned int armedTick = 0;
+volatile int schedDepth = 0;
+volatile sig_atomic_t schedPending = 0;
+bool inInterrupt = false;
 int threadCnt = 0;
 int mutexCnt = 0;
 
@@ -198,6 +229,13 @@ int FATStartByte = 0;
 TVMMutexID fatMutex;
 TVMMutexID sharedMemMutex;
 uint8_t* FATcache;
+// Image mapped by a mapped mount, metadata is read and written in place
+// and the dirty byte range is msync'd on close and at shutdown
+bool mountMapped = false;
+uint8_t* FATImage = NULL;
+int FATImageSize = 0;
+int FATDirtyStart = -1;
+int FATDirtyEnd = -1;
 std::vector<FATFile*> filesCache;
 std::vector<FATFile*> openFiles;
 
@@ -206,6 +244,11 @@ std::vector<Thread*> threadList;
 std::vector<Mutex*> mutexList;
 std::priority_queue<Thread*, std::vector<Thread*>, TCBCompareTimeup> waitingThreadList;
 std::priority_queue<Thread*, std::vector<Thread*>, TCBComparePrio> readyThreadList;
+// Threads waiting on a read that is cancelled at their fileTimeup
+std::vector<Thread*> fileTimeoutList;
+// Threads waiting for a shared chunk, woken when one is given back or at
+// their fileTimeup when it is not VM_TIMEOUT_INFINITE
+std::vector<Thread*> sharedMemWaitList;
 //=============== ==============================================
 
 // HELPER FUNCTIONS
@@ -215,8 +258,16 @@ void EmptyMain(void* param){
 }
 
 void IdleMain(void* param){
+    TMachineSignalState sigstate;
     while(1){
         //std::cout << "-idling.." << "\n";
+        //Work flagged while the lock was held is checked with signals held so none is missed
+        MachineSuspendSignals(&sigstate);
+        if(!schedPending)
+            MachineWaitSignal();
+        MachineResumeSignals(&sigstate);
+        SchedulerLock();
+        SchedulerUnlock();
     }
 }
 
@@ -231,7 +282,115 @@ void ArrayCopy(const uint8_t* src, uint8_t* dest, int index, int len){
 #define WAIT_FOR_FILE        2
 #define WAIT_FOR_MUTEX       3
 #define THREAD_TERMINATED    4
+#define WAIT_FOR_MEMORY      5
+
+// Scheduler state is guarded by a depth count instead of masking signals.
+// A tick or reply that lands while it is held only sets schedPending, and
+// the work is picked up when the outermost holder unlocks.
+void SchedulerLock(){
+    __atomic_add_fetch(&schedDepth, 1, __ATOMIC_SEQ_CST);
+}
+
+void SchedulerUnlock(){
+    if(__atomic_sub_fetch(&schedDepth, 1, __ATOMIC_SEQ_CST) == 0 && schedPending && runningThread != NULL)
+        threadSchedule(WAIT_FOR_PRIO);
+}
+
+//Microseconds since VMStart
+long long ElapsedUS(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - startTime.tv_sec) * 1000000LL + (now.tv_nsec - startTime.tv_nsec) / 1000;
+}
+
+void UpdateTick(){
+    if(tickless)
+        g_tick = ElapsedUS() / (1000LL * tickMS);
+}
+
+//Programs the alarm for the earliest sleeper or read deadline unless it already is
+void ArmAlarm(){
+    if(!tickless)
+        return;
+    bool armed = !waitingThreadList.empty();
+    unsigned int next = armed ? waitingThreadList.top()->timeup : 0;
+    for(auto it = fileTimeoutList.begin(); it != fileTimeoutList.end(); ++it){
+        if(!armed || (*it)->fileTimeup < next)
+            next = (*it)->fileTimeup;
+        armed = true;
+    }
+    for(auto it = sharedMemWaitList.begin(); it != sharedMemWaitList.end(); ++it){
+        if((*it)->fileTimeup == VM_TIMEOUT_INFINITE)
+            continue;
+        if(!armed || (*it)->fileTimeup < next)
+            next = (*it)->fileTimeup;
+        armed = true;
+    }
+    if(!armed || next == armedTick)
+        return;
+    armedTick = next;
+    long long delay = armedTick * 1000LL * tickMS - ElapsedUS();
+    MachineProgramAlarm(delay > 0 ? delay : 1);
+}
+
+// Wakes sleepers whose time is up and runs the callbacks of finished file
+// requests, called with the scheduler locked
+void SchedulerPoll(){
+    UpdateTick();
+    while(!waitingThreadList.empty() && waitingThreadList.top()->timeup <= g_tick){
+        Thread* t = waitingThreadList.top();
+        waitingThreadList.pop();
+        t->state = VM_THREAD_STATE_READY;
+        readyThreadList.push(t);
+    }
+    MachineProcessReplies();
+    //Reads past their deadline are cancelled, the thread wakes on the cancelled reply
+    for(auto it = fileTimeoutList.begin(); it != fileTimeoutList.end();){
+        if((*it)->fileTimeup <= g_tick){
+            MachineFileCancel(&FileCallback, *it);
+            it = fileTimeoutList.erase(it);
+        }
+        else
+            ++it;
+    }
+    for(auto it = sharedMemWaitList.begin(); it != sharedMemWaitList.end();){
+        if((*it)->fileTimeup != VM_TIMEOUT_INFINITE && (*it)->fileTimeup <= g_tick){
+            (*it)->state = VM_THREAD_STATE_READY;
+            readyThreadList.push(*it);
+            it = sharedMemWaitList.erase(it);
+        }
+        else
+            ++it;
+    }
+    ArmAlarm();
+}
+
+// Called from the alarm and reply signal handlers, a thread that makes no
+// VM calls is only preempted here
+void SchedulerInterrupt(){
+    if(schedDepth != 0 || runningThread == NULL){
+        schedPending = 1;
+        return;
+    }
+    inInterrupt = true;
+    threadSchedule(WAIT_FOR_PRIO);
+    inInterrupt = false;
+}
+
 void threadSchedule(int scheduleType){
+    SchedulerLock();
+    Thread* prev = runningThread;
+    Thread* next = NULL;
+
+    //Waiting threads are marked before polling so their own completion requeues them
+    if(scheduleType == WAIT_FOR_FILE || scheduleType == WAIT_FOR_MUTEX || scheduleType == WAIT_FOR_MEMORY)
+        prev->state = VM_THREAD_STATE_WAITING;
+    else if(scheduleType == WAIT_FOR_SLEEP){
+        prev->state = VM_THREAD_STATE_READY;
+        waitingThreadList.push(prev);
+    }
+    schedPending = 0;
+    SchedulerPoll();
 
     //Gets rid of dead threads from ready list
     while(readyThreadList.top()->state == VM_THREAD_STATE_DEAD){
@@ -240,98 +399,99 @@ void threadSchedule(int scheduleType){
 
     if(scheduleType == WAIT_FOR_PRIO){
         if(runningThread->prio < readyThreadList.top()->prio){
-            MachineSuspendSignals(&sigState);
-            Thread* prev = runningThread;
-            Thread* next = readyThreadList.top();
-            //std::cout << "-switching from thread " << prev->tid << " to " << next->tid << "\n";
+            next = readyThreadList.top();
             readyThreadList.pop();
             prev->state = VM_THREAD_STATE_READY;
             readyThreadList.push(prev);
-            runningThread = next;
-            runningThread->state = VM_THREAD_STATE_RUNNING;
-            MachineResumeSignals(&sigState);
-            MachineContextSwitch(&prev->cntx, &next->cntx);
         }
     }
-    else if(scheduleType == WAIT_FOR_SLEEP){
-        MachineSuspendSignals(&sigState);
-        Thread* prev = runningThread;
-        Thread* next = readyThreadList.top();
+    else{
+        next = readyThreadList.top();
         readyThreadList.pop();
-        prev->state = VM_THREAD_STATE_READY;
-        waitingThreadList.push(prev);
-        runningThread = next;
-        runningThread->state = VM_THREAD_STATE_RUNNING;
-        MachineResumeSignals(&sigState);
-        MachineContextSwitch(&prev->cntx, &next->cntx);
     }
-    else if(scheduleType == WAIT_FOR_FILE || scheduleType ==  WAIT_FOR_MUTEX){
-        MachineSuspendSignals(&sigState);
-        Thread* prev = runningThread;
-        Thread* next = readyThreadList.top();
-        //std::cout << "-switching from thread " << prev->tid << " to " << next->tid << "\n";
-        readyThreadList.pop();
-        prev->state = VM_THREAD_STATE_WAITING;
-        runningThread = next;
-        runningThread->state = VM_THREAD_STATE_RUNNING;
-        MachineResumeSignals(&sigState);
-        MachineContextSwitch(&prev->cntx, &next->cntx);
+
+    if(next == NULL || next == prev){
+        prev->state = VM_THREAD_STATE_RUNNING;
+        SchedulerUnlock();
+        return;
     }
-    else if(scheduleType == THREAD_TERMINATED){
-        MachineSuspendSignals(&sigState);
-        runningThread = readyThreadList.top();
-        readyThreadList.pop();
-        runningThread->state = VM_THREAD_STATE_RUNNING;
+    //std::cout << "-switching from thread " << prev->tid << " to " << next->tid << "\n";
+    runningThread = next;
+    runningThread->state = VM_THREAD_STATE_RUNNING;
+    //Switching away inside a handler would leave its mask on the next thread
+    if(inInterrupt){
+        inInterrupt = false;
+        MachineEnableSignals();
+    }
+    int depth = schedDepth;
+    if(scheduleType == THREAD_TERMINATED){
         SMachineContext tmp;
-        MachineResumeSignals(&sigState);
         MachineContextSwitch(&tmp, &runningThread->cntx);
     }
+    else{
+        MachineContextSwitch(&prev->cntx, &next->cntx);
+    }
+    schedDepth = depth;
+    SchedulerUnlock();
 }
 
 void AlarmCallback(void* calldata){
     //std::cout << "-AlARM" << "\n";
-    MachineSuspendSignals(&sigState);
-    g_tick++;
-    if(!waitingThreadList.empty()){
-        if(waitingThreadList.top()->timeup <= g_tick){
-            Thread* t = waitingThreadList.top();
-            waitingThreadList.pop();
-            t->state = VM_THREAD_STATE_READY;
-            readyThreadList.push(t);
-        }
+    if(tickless){
+        armedTick = 0;
+        UpdateTick();
     }
-    MachineResumeSignals(&sigState);
-    threadSchedule(WAIT_FOR_PRIO);
+    else
+        g_tick++;
+    SchedulerInterrupt();
 }
 
+void ReplyCallback(void* calldata){
+    SchedulerInterrupt();
+}
+
+// Runs from SchedulerPoll, the woken thread is scheduled by its caller
 void FileCallback(void* calldata, int result){
     //std::cout << "-Thread " << ((Thread*)(calldata))->tid << " filecallback\n";
-    MachineSuspendSignals(&sigState);
     Thread *t = (Thread*)(calldata);
     t->state = VM_THREAD_STATE_READY;
     t->fileResult = result;
     readyThreadList.push(t);
-    MachineResumeSignals(&sigState);
-    threadSchedule(WAIT_FOR_PRIO);
 }
 
 // Skeleton function
 void ThreadWrapper(void* param){
     Thread* t = (Thread*)(param);
+    //New threads start inside threadSchedule's lock
+    schedDepth = 1;
+    SchedulerUnlock();
     (t->entry)(t->param);
     VMThreadTerminate(t->tid);
 }
 
+// Pointer to len bytes of the mapped image at offset, NULL if the mount is
+// not mapped or the range is outside the image
+uint8_t* FATMapped(int offset, int len){
+    if(FATImage == NULL || offset < 0 || len < 0 || offset + len > FATImageSize)
+        return NULL;
+    return FATImage + offset;
+}
+
 // Returns byte index of next free root entry in cache
 int FindFreeRootEntry(){
-    int offset;
-    uint8_t tempEntry[32];
-    int len = 32;
-    FileSeek(FATFd, (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512, SEEK_SET , &offset);
-    for(int i = 0; i < BPBcache->BPB_RootEntCnt; i++){
-        FileRead(FATFd, tempEntry, &len);
-        if(tempEntry[0] == 0x00 || tempEntry[0] == 0xE5){
-            return (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512 + i*32;
+    int rootStart = (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512;
+    int len = BPBcache->BPB_RootEntCnt * 32;
+    std::vector<uint8_t> rootCopy;
+    uint8_t* root = FATMapped(rootStart, len);
+    if(root == NULL){
+        rootCopy.resize(len);
+        root = rootCopy.data();
+        if(FileReadAt(FATFd, rootStart, root, &len) != VM_STATUS_SUCCESS)
+            return -1;
+    }
+    for(int i = 0; i < len/32; i++){
+        if(root[i*32] == 0x00 || root[i*32] == 0xE5){
+            return rootStart + i*32;
         }
     }
     return -1;
@@ -339,18 +499,35 @@ int FindFreeRootEntry(){
 
 // Returns FAT index of next free FAT entry
 int FindFreeFATEntry(){
-    int offset;
-    uint16_t tempEntry[2];
-    int len = 2;
-    FileSeek(FATFd, BPBcache->BPB_RsvdSecCnt*512, SEEK_SET , &offset);
-    for(int i = 0; i < BPBcache->BPB_FATSz16*512; i+=2){
-        FileRead(FATFd, tempEntry, &len);
-        if(tempEntry[0] == 0 && tempEntry[1] == 0){
+    int len = BPBcache->BPB_FATSz16*512;
+    std::vector<uint8_t> fatCopy;
+    uint8_t* fat = FATMapped(BPBcache->BPB_RsvdSecCnt*512, len);
+    if(fat == NULL){
+        fatCopy.resize(len);
+        fat = fatCopy.data();
+        if(FileReadAt(FATFd, BPBcache->BPB_RsvdSecCnt*512, fat, &len) != VM_STATUS_SUCCESS)
+            return -1;
+    }
+    for(int i = 0; i + 1 < len; i+=2){
+        if(fat[i] == 0 && fat[i+1] == 0){
             return  i;
         }
     }
     return -1;
 }
+
+FATFile* FindOpenFile(int filedescriptor){
+    for(auto it = openFiles.begin(); it != openFiles.end(); ++it){
+        if((*it)->fd == filedescriptor)
+            return *it;
+    }
+    return NULL;
+}
+
+// Byte index of a file's data, files live in a single run from their first cluster
+int FATDataOffset(FATFile* file){
+    return (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512  + (BPBcache->BPB_RootEntCnt * 32) + (file->FATindex-2)*BPBcache->BPB_BytsPerSec;
+}
 //=============================================================
 
 // FILE OPERATIONS
@@ -359,9 +536,10 @@ TVMStatus FileOpen(const char *filename, int flags, int mode, int *filedescripto
     if(filename == NULL || filedescriptor == NULL)
         return VM_STATUS_ERROR_INVALID_PARAMETER;
 
+    SchedulerLock();
     MachineFileOpen(filename, flags, mode, &FileCallback, runningThread);
-
     threadSchedule(WAIT_FOR_FILE);
+    SchedulerUnlock();
 
     if(runningThread->fileResult < 0)
         return VM_STATUS_FAILURE;
@@ -372,9 +550,10 @@ TVMStatus FileOpen(const char *filename, int flags, int mode, int *filedescripto
 }
 
 TVMStatus FileClose(int filedescriptor){
+    SchedulerLock();
     MachineFileClose(filedescriptor, &FileCallback, runningThread);
-
     threadSchedule(WAIT_FOR_FILE);
+    SchedulerUnlock();
 
     if(runningThread->fileResult < 0)
         return VM_STATUS_FAILURE;
@@ -383,53 +562,235 @@ TVMStatus FileClose(int filedescriptor){
     }
 }
 
+// Takes as many 512 byte chunks as are free (up to the per request limit)
+// to cover len bytes, returns the number of segments filled
+int SharedMemTake(SMachineFileSegment* segments, int len){
+    int count = 0;
+    while(len > 0 && count < sharedMem->takeLimit && !sharedMem->memChunks.empty()){
+        segments[count].DData = sharedMem->memChunks.back();
+        segments[count].DLength = (len < 512) ? len : 512;
+        sharedMem->memChunks.pop_back();
+        len -= segments[count].DLength;
+        count++;
+    }
+    return count;
+}
+
+// Blocks the running thread until a chunk is given back or timeup passes,
+// called with the scheduler locked
+void SharedMemWait(TVMTick timeup){
+    runningThread->fileTimeup = timeup;
+    sharedMemWaitList.push_back(runningThread);
+    ArmAlarm();
+    threadSchedule(WAIT_FOR_MEMORY);
+}
+
+// Readies every thread waiting for a chunk, they retry in priority order.
+// A higher priority waiter preempts once the scheduler is unlocked.
+void SharedMemWake(){
+    for(auto it = sharedMemWaitList.begin(); it != sharedMemWaitList.end(); ++it){
+        (*it)->state = VM_THREAD_STATE_READY;
+        readyThreadList.push(*it);
+        if((*it)->prio > runningThread->prio)
+            schedPending = 1;
+    }
+    sharedMemWaitList.clear();
+}
+
+void SharedMemGive(SMachineFileSegment* segments, int count){
+    for(int i = count - 1; i >= 0; i--){
+        sharedMem->memChunks.push_back(segments[i].DData);
+    }
+    SharedMemWake();
+}
+
+// Lends the longest run of adjacent free chunks (up to len bytes) as one
+// buffer, returns the bytes lent or 0 if nothing can be lent. One chunk is
+// always left for FileRead/FileWrite so a thread holding buffers can still print.
+int SharedMemLend(int len, void **data){
+    std::vector<void*>& chunks = sharedMem->memChunks;
+    if(chunks.size() < 2 || len <= 0)
+        return 0;
+
+    std::sort(chunks.begin(), chunks.end());
+    int want = (len + 511) / 512;
+    if(want > (int)chunks.size() - 1)
+        want = chunks.size() - 1;
+    int bestStart = 0, bestCount = 1;
+    for(int start = 0; start < (int)chunks.size() && bestCount < want;){
+        int count = 1;
+        while(start + count < (int)chunks.size() && count < want && (char*)chunks[start + count] == (char*)chunks[start] + count*512)
+            count++;
+        if(count > bestCount){
+            bestStart = start;
+            bestCount = count;
+        }
+        start += count;
+    }
+    *data = chunks[bestStart];
+    chunks.erase(chunks.begin() + bestStart, chunks.begin() + bestStart + bestCount);
+    sharedMem->lentChunks[*data] = bestCount;
+    return (len < bestCount*512) ? len : bestCount*512;
+}
+
+// Size of a lent buffer, 0 if data is not the start of one
+int SharedMemLentSize(void *data){
+    auto it = sharedMem->lentChunks.find(data);
+    if(it == sharedMem->lentChunks.end())
+        return 0;
+    return it->second * 512;
+}
+
+bool SharedMemReturn(void *data){
+    auto it = sharedMem->lentChunks.find(data);
+    if(it == sharedMem->lentChunks.end())
+        return false;
+    for(int i = 0; i < it->second; i++)
+        sharedMem->memChunks.push_back((char*)data + i*512);
+    sharedMem->lentChunks.erase(it);
+    SharedMemWake();
+    return true;
+}
+
 TVMStatus FileRead(int filedescriptor, void *data, int *length){
+    return FileReadAt(filedescriptor, -1, data, length);
+}
+
+// Reads at offset without moving the file position, a negative offset
+// reads at the current position instead
+TVMStatus FileReadAt(int filedescriptor, int offset, void *data, int *length){
+    return FileReadTimed(filedescriptor, offset, data, length, VM_TIMEOUT_INFINITE);
+}
+
+// FileReadAt that gives up once timeout ticks have passed, a read cancelled
+// before anything arrived fails with a length of 0
+TVMStatus FileReadTimed(int filedescriptor, int offset, void *data, int *length, TVMTick timeout){
     if(data == NULL || length == NULL)
         return VM_STATUS_ERROR_INVALID_PARAMETER;
 
-    void* mem;
+    UpdateTick();
+    TVMTick timeup = (timeout == VM_TIMEOUT_IMMEDIATE) ? g_tick : g_tick + timeout;
+    SMachineFileSegment segments[MACHINE_MAX_FILE_SEGMENTS];
     int k = 0;
-    for(int i = *length; i > 0; i -= 512){
-        int len = (i < 512) ? i : 512;
-        mem = sharedMem->memChunks.back();
-        sharedMem->memChunks.pop_back();
-        MachineFileRead(filedescriptor, mem, len, &FileCallback, runningThread);
+    for(int i = *length; i > 0;){
+        SchedulerLock();
+        int count = SharedMemTake(segments, i);
+        if(count == 0){
+            UpdateTick();
+            if(timeout != VM_TIMEOUT_INFINITE && g_tick >= timeup){
+                SchedulerUnlock();
+                *length = k;
+                return k ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
+            }
+            SharedMemWait(timeout == VM_TIMEOUT_INFINITE ? VM_TIMEOUT_INFINITE : timeup);
+            SchedulerUnlock();
+            continue;
+        }
+        int len = 0;
+        for(int j = 0; j < count; j++)
+            len += segments[j].DLength;
+        if(offset < 0)
+            MachineFileReadV(filedescriptor, segments, count, &FileCallback, runningThread);
+        else
+            MachineFileReadAtV(filedescriptor, segments, count, offset + k, &FileCallback, runningThread);
+        if(timeout != VM_TIMEOUT_INFINITE){
+            runningThread->fileTimeup = timeup;
+            fileTimeoutList.push_back(runningThread);
+        }
         threadSchedule(WAIT_FOR_FILE);
-        memcpy(data, mem, len);
-        data = (char*)data + len;
-        sharedMem->memChunks.push_back(mem);
-        k+=runningThread->fileResult;
+        auto pending = std::find(fileTimeoutList.begin(), fileTimeoutList.end(), runningThread);
+        if(pending != fileTimeoutList.end())
+            fileTimeoutList.erase(pending);
+        SchedulerUnlock();
+
+        int result = runningThread->fileResult;
+        for(int j = 0, copied = 0; j < count && copied < result; j++){
+            int n = (result - copied < segments[j].DLength) ? result - copied : segments[j].DLength;
+            memcpy((char*)data + copied, segments[j].DData, n);
+            copied += n;
+        }
+        SchedulerLock();
+        SharedMemGive(segments, count);
+        SchedulerUnlock();
+        if(result == MACHINE_FILE_CANCELLED){
+            *length = k;
+            return k ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
+        }
+        if(result < 0)
+            return VM_STATUS_FAILURE;
+        k += result;
+        data = (char*)data + result;
+        i -= len;
+        //Short read means EOF or nothing more available right now
+        if(result < len)
+            break;
     }
 
-    if(runningThread->fileResult < 0)
-        return VM_STATUS_FAILURE;
-    else{
-        *length = k;
-        return VM_STATUS_SUCCESS;
-    }
+    *length = k;
+    return VM_STATUS_SUCCESS;
 }
 
 TVMStatus FileWrite(int filedescriptor, void *data, int *length){
+    return FileWriteAt(filedescriptor, -1, data, length);
+}
+
+// Console output is buffered by the machine and written out by the child,
+// the thread only waits while the buffer is full
+TVMStatus ConsoleWrite(int filedescriptor, void *data, int *length){
     if(data == NULL || length == NULL)
         return VM_STATUS_ERROR_INVALID_PARAMETER;
 
-    VMMutexAcquire(sharedMemMutex, VM_TIMEOUT_INFINITE);
-    MachineSuspendSignals(&sigState);
-    void* mem = NULL;
-    for(int i = *length; i > 0; i -= 512){
-        if(!sharedMem->memChunks.empty()){
-            mem = sharedMem->memChunks.back();
-            sharedMem->memChunks.pop_back();
-        }
+    int k = 0;
+    while(k < *length){
+        SchedulerLock();
+        int n = MachineConsoleWrite(filedescriptor, (char*)data + k, *length - k);
+        SchedulerUnlock();
+        if(n < 0)
+            return VM_STATUS_FAILURE;
+        if(n == 0)
+            threadSchedule(WAIT_FOR_PRIO);
+        k += n;
+    }
+    return VM_STATUS_SUCCESS;
+}
 
-        int len = (i < 512) ? i : 512;
+// Writes at offset without moving the file position, a negative offset
+// writes at the current position instead
+TVMStatus FileWriteAt(int filedescriptor, int offset, void *data, int *length){
+    if(data == NULL || length == NULL)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
 
-        memcpy(mem, data, len);
-        MachineFileWrite(filedescriptor, mem, len, &FileCallback, runningThread);
+    VMMutexAcquire(sharedMemMutex, VM_TIMEOUT_INFINITE);
+    SMachineFileSegment segments[MACHINE_MAX_FILE_SEGMENTS];
+    int k = 0;
+    for(int i = *length; i > 0;){
+        SchedulerLock();
+        int count = SharedMemTake(segments, i);
+        if(count == 0){
+            SharedMemWait(VM_TIMEOUT_INFINITE);
+            SchedulerUnlock();
+            continue;
+        }
+        int len = 0;
+        for(int j = 0; j < count; j++){
+            memcpy(segments[j].DData, (char*)data + len, segments[j].DLength);
+            len += segments[j].DLength;
+        }
+        if(offset < 0)
+            MachineFileWriteV(filedescriptor, segments, count, &FileCallback, runningThread);
+        else
+            MachineFileWriteAtV(filedescriptor, segments, count, offset + k, &FileCallback, runningThread);
 
-        MachineResumeSignals(&sigState);
         threadSchedule(WAIT_FOR_FILE);
-        sharedMem->memChunks.push_back(mem);
+        SchedulerUnlock();
+        SchedulerLock();
+        SharedMemGive(segments, count);
+        SchedulerUnlock();
+        if(runningThread->fileResult < 0)
+            break;
+        k += runningThread->fileResult;
+        data = (char*)data + len;
+        i -= len;
     }
     VMMutexRelease(sharedMemMutex);
 
@@ -438,15 +799,88 @@ TVMStatus FileWrite(int filedescriptor, void *data, int *length){
     if(runningThread->fileResult < 0)
         return VM_STATUS_FAILURE;
     else{
-        *length = runningThread->fileResult;
+        *length = k;
+        return VM_STATUS_SUCCESS;
+    }
+}
+
+// Single request straight into or out of a lent shared buffer, so no copy
+// is made. A negative offset uses the current file position.
+int FileTransferShared(bool write, int filedescriptor, int offset, void *data, int length){
+    SchedulerLock();
+    if(write && offset < 0)
+        MachineFileWrite(filedescriptor, data, length, &FileCallback, runningThread);
+    else if(write)
+        MachineFileWriteAt(filedescriptor, data, length, offset, &FileCallback, runningThread);
+    else if(offset < 0)
+        MachineFileRead(filedescriptor, data, length, &FileCallback, runningThread);
+    else
+        MachineFileReadAt(filedescriptor, data, length, offset, &FileCallback, runningThread);
+    threadSchedule(WAIT_FOR_FILE);
+    SchedulerUnlock();
+    return runningThread->fileResult;
+}
+
+// Metadata access to the image, in place when the mount is mapped and
+// through the machine otherwise
+TVMStatus FATRead(int offset, void *data, int *length){
+    if(FATImage == NULL)
+        return FileReadAt(FATFd, offset, data, length);
+    if(data == NULL || length == NULL || offset < 0)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    if(offset + *length > FATImageSize)
+        *length = (offset < FATImageSize) ? FATImageSize - offset : 0;
+    memcpy(data, FATImage + offset, *length);
+    return VM_STATUS_SUCCESS;
+}
+
+TVMStatus FATWrite(int offset, void *data, int *length){
+    if(FATImage == NULL)
+        return FileWriteAt(FATFd, offset, data, length);
+    if(data == NULL || length == NULL || offset < 0)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    if(offset + *length > FATImageSize)
+        *length = (offset < FATImageSize) ? FATImageSize - offset : 0;
+    memcpy(FATImage + offset, data, *length);
+    if(FATDirtyStart < 0 || offset < FATDirtyStart)
+        FATDirtyStart = offset;
+    if(offset + *length > FATDirtyEnd)
+        FATDirtyEnd = offset + *length;
+    return VM_STATUS_SUCCESS;
+}
+
+// Writes the dirty part of the mapped image back to the file
+void FATSync(){
+    if(FATImage == NULL || FATDirtyStart < 0)
+        return;
+    int pageStart = FATDirtyStart & ~(getpagesize() - 1);
+    msync(FATImage + pageStart, FATDirtyEnd - pageStart, MS_SYNC);
+    FATDirtyStart = FATDirtyEnd = -1;
+}
+
+// Waits for the file to reach disk, syncs from other threads that are
+// waiting at the same time go out as one flush
+TVMStatus FileSync(int filedescriptor, bool dataOnly){
+    SchedulerLock();
+    if(dataOnly)
+        MachineFileDataSync(filedescriptor, &FileCallback, runningThread);
+    else
+        MachineFileSync(filedescriptor, &FileCallback, runningThread);
+    threadSchedule(WAIT_FOR_FILE);
+    SchedulerUnlock();
+
+    if(runningThread->fileResult < 0)
+        return VM_STATUS_FAILURE;
+    else{
         return VM_STATUS_SUCCESS;
     }
 }
 
 TVMStatus FileSeek(int filedescriptor, int offset, int whence, int *newoffset){
+    SchedulerLock();
     MachineFileSeek(filedescriptor, offset, whence, &FileCallback, runningThread);
-
     threadSchedule(WAIT_FOR_FILE);
+    SchedulerUnlock();
 
     if(runningThread->fileResult < 0)
         return VM_STATUS_FAILURE;
@@ -455,12 +889,21 @@ TVMStatus FileSeek(int filedescriptor, int offset, int whence, int *newoffset){
         return VM_STATUS_SUCCESS;
     }
 }
+
 //=====================================================================================================
 
 
 
 // BASIC OPERATIONS
 //=====================================================================================================
+void VMSetMountMapped(int mapped){
+    mountMapped = mapped != 0;
+}
+
+void VMSetTickless(int enable){
+    tickless = enable != 0;
+}
+
 TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int argc, char *argv[]){
     TVMMainEntry main = VMLoadModule(argv[0]);
     tickMS = tickms;
@@ -468,11 +911,16 @@ TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int a
     sharedMem = new SharedMem();
     VMMutexCreate(&sharedMemMutex);
     void* memPtr = MachineInitialize(sharedsize);
+    MachineRequestReplyCallback(&ReplyCallback, NULL);
     sharedMem->Initialize(memPtr, sharedsize);
 
     //test = MachineInitialize(sharedsize);
     MachineEnableSignals();
     MachineRequestAlarm(useconds_t(1000 * tickMS), &AlarmCallback, &tickMS);
+    if(tickless){
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+        MachineProgramAlarm(0);
+    }
 
     //Create main and idle threads, with IDs idle = 0, main = 1, set current thread to 1
     TVMThreadID id0 = 0, id1 = 1;
@@ -492,29 +940,43 @@ TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int a
     uint8_t tmpBPB[512];
     int len = 512;
     FileOpen(mount, O_RDWR, 0600, &FATFd);;
-    FileRead(FATFd, tmpBPB, &len);
+    if(mountMapped){
+        //Map the image directly, file data still goes through FATFd
+        int mapFd = open(mount, O_RDWR);
+        struct stat mapStat;
+        if(mapFd >= 0 && fstat(mapFd, &mapStat) == 0 && mapStat.st_size > 0){
+            void* image = mmap(NULL, mapStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mapFd, 0);
+            if(image != MAP_FAILED){
+                FATImage = (uint8_t*)image;
+                FATImageSize = mapStat.st_size;
+            }
+        }
+        if(mapFd >= 0)
+            close(mapFd);
+        if(FATImage == NULL)
+            std::cerr << "Failed to map " << mount << ", using file I/O\n";
+    }
+    FATRead(0, tmpBPB, &len);
     BPBcache->LoadFromSector(tmpBPB);
     BPBcache->PrintFATInfo();
 
-    int offset;
-
     // Load FAT cache
     FATStartByte = BPBcache->BPB_RsvdSecCnt*512;
     len = BPBcache->BPB_RsvdSecCnt*512;
     uint8_t tmpFAT[len];
-    for(int i = 0; i < len; i++){
-        FileSeek(FATFd, len, SEEK_SET, &offset);
-        FileRead(FATFd, tmpFAT, &len);
+    FATcache = FATMapped(len, len);
+    if(FATcache == NULL){
+        FileReadAt(FATFd, len, tmpFAT, &len);
+        FATcache = tmpFAT;
     }
-    FATcache = tmpFAT;
 
 
     // Loads existing files into cache
-    uint8_t tmpRootEntry[32];
-    len = 32;
-    FileSeek(FATFd, (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512, SEEK_SET , &offset);
-    for(int i = 0; i < BPBcache->BPB_RootEntCnt; i++){
-        FileRead(FATFd, tmpRootEntry, &len);
+    len = BPBcache->BPB_RootEntCnt * 32;
+    std::vector<uint8_t> rootDir(len);
+    FATRead((BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512, rootDir.data(), &len);
+    for(int i = 0; i < len/32; i++){
+        uint8_t* tmpRootEntry = &rootDir[i*32];
         if(tmpRootEntry[0] == 0x00)
             break;
         else if((tmpRootEntry[11] == 0xf) || (tmpRootEntry[11] == 0x10) ||  (tmpRootEntry[0] == 0xE5))
@@ -532,6 +994,9 @@ TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int a
     }
 
     main(argc, argv);
+    FATSync();
+    if(FATImage != NULL)
+        munmap(FATImage, FATImageSize);
     MachineTerminate();
     VMUnloadModule();
     return VM_STATUS_SUCCESS;
@@ -547,6 +1012,7 @@ TVMStatus VMTickMS(int *tickmsref){
 TVMStatus VMTickCount(TVMTickRef tickref){
     if(tickref == NULL)
         return VM_STATUS_ERROR_INVALID_PARAMETER;
+    UpdateTick();
     *tickref = g_tick;
     return VM_STATUS_SUCCESS;
 }
@@ -565,7 +1031,6 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
         }
     }
 
-    int offset;
     int len = 32;
     uint8_t newEntry[32];
     std::strcpy((char*)newEntry, filename);
@@ -577,8 +1042,7 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
     newEntry[28] = newEntry[29] = 0;
 
     int newRootEntryIndex = FindFreeRootEntry();
-    FileSeek(FATFd, newRootEntryIndex, SEEK_SET, &offset);
-    FileWrite(FATFd, newEntry, &len);
+    FATWrite(newRootEntryIndex, newEntry, &len);
 
     FATFile* newFile = new FATFile();
     newFile->fd = openFiles.size()+3;
@@ -595,6 +1059,7 @@ TVMStatus VMFileClose(int filedescriptor){
     if(filedescriptor < 3){
         return FileClose(filedescriptor);
     }
+    FATSync();
     return VM_STATUS_SUCCESS;
 }
 
@@ -604,14 +1069,12 @@ TVMStatus VMFileRead(int filedescriptor, void *data, int *length){
     }
     else{
         //VMMutexAcquire(fatMutex, VM_TIMEOUT_INFINITE);
-        for(auto it = openFiles.begin(); it != openFiles.end(); ++it){
-            if((*it)->fd == filedescriptor){
-                int offset;
-
-                FileSeek(FATFd, (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512  + (BPBcache->BPB_RootEntCnt * 32) + ((*it)->FATindex-2)*BPBcache->BPB_BytsPerSec, SEEK_SET , &offset);
-                FileRead(FATFd, data, length);
-                return VM_STATUS_SUCCESS;
-            }
+        FATFile* file = FindOpenFile(filedescriptor);
+        if(file != NULL){
+            //Reads always start at the first cluster, stop at the end of the file
+            if(*length > (int)file->rootEntry.DSize)
+                *length = file->rootEntry.DSize;
+            return FileReadAt(FATFd, FATDataOffset(file), data, length);
         }
         //VMMutexRelease(fatMutex);
     }
@@ -619,7 +1082,19 @@ TVMStatus VMFileRead(int filedescriptor, void *data, int *length){
     return VM_STATUS_ERROR_INVALID_PARAMETER;
 }
 
+// Console reads can wait forever for input, this one is cancelled after
+// timeout ticks. FAT file reads never wait on input and ignore it.
+TVMStatus VMFileReadTimeout(int filedescriptor, void *data, int *length, TVMTick timeout){
+    if(filedescriptor < 3){
+        return FileReadTimed(filedescriptor, -1, data, length, timeout);
+    }
+    return VMFileRead(filedescriptor, data, length);
+}
+
 TVMStatus VMFileWrite(int filedescriptor, void *data, int *length){
+    if(filedescriptor == 1 || filedescriptor == 2){
+        return ConsoleWrite(filedescriptor, data, length);
+    }
     if(filedescriptor < 3){
         return FileWrite(filedescriptor, data, length);
     }
@@ -627,18 +1102,16 @@ TVMStatus VMFileWrite(int filedescriptor, void *data, int *length){
         //VMMutexAcquire(fatMutex, VM_TIMEOUT_INFINITE);
         for(auto it = openFiles.begin(); it != openFiles.end(); ++it){
             if((*it)->fd == filedescriptor) {
-                int offset;
-
-                FileSeek(FATFd, (BPBcache->BPB_RsvdSecCnt + (BPBcache->BPB_NumFATs * BPBcache->BPB_FATSz16))*512  + (BPBcache->BPB_RootEntCnt * 32) + ((*it)->FATindex-2)*BPBcache->BPB_BytsPerSec, SEEK_SET , &offset);
-                FileWrite(FATFd, data, length);
+                FileWriteAt(FATFd, FATDataOffset(*it), data, length);
+                if(*length > (int)(*it)->rootEntry.DSize)
+                    (*it)->rootEntry.DSize = *length;
 
                 /*
                 int len = 2;
                 uint8_t size[2];
                 size[0] = (*length + (*it)->rootEntry.DSize) << 8 >> 8;
                 size[1] = (*length + (*it)->rootEntry.DSize) >>8;
-                FileSeek(FATFd, (*it)->rootEntryByteIndex, SEEK_SET, &offset);
-                FileWrite(FATFd, size, &len);
+                FileWriteAt(FATFd, (*it)->rootEntryByteIndex, size, &len);
 */
                 return VM_STATUS_SUCCESS;
             }
@@ -648,6 +1121,19 @@ TVMStatus VMFileWrite(int filedescriptor, void *data, int *length){
     return VM_STATUS_SUCCESS;
 }
 
+// FAT files live in the image, so their data and the metadata written by
+// VMFileOpen are durable once the image is. Its size never changes, so a
+// data sync is enough.
+TVMStatus VMFileSync(int filedescriptor){
+    if(filedescriptor < 3){
+        return FileSync(filedescriptor, false);
+    }
+    if(FindOpenFile(filedescriptor) == NULL)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    FATSync();
+    return FileSync(FATFd, true);
+}
+
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset){
     if(filedescriptor < 3){
         return FileSeek(filedescriptor, offset, whence, newoffset);
@@ -667,7 +1153,7 @@ TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsiz
     if (entry == NULL || tidRef == NULL)
         return VM_STATUS_ERROR_INVALID_PARAMETER;
 
-    MachineSuspendSignals(&sigState);
+    SchedulerLock();
     //Thread creation
     Thread *t = new Thread();
     t->tid = threadCnt;
@@ -681,7 +1167,7 @@ TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsiz
     *tidRef = threadCnt;
     threadCnt++;
 
-    MachineResumeSignals(&sigState);
+    SchedulerUnlock();
     return VM_STATUS_SUCCESS;
 }
 
@@ -692,9 +1178,9 @@ TVMStatus VMThreadDelete(TVMThreadID threadID){
                 return VM_STATUS_ERROR_INVALID_STATE;
             }
             else{
-                MachineSuspendSignals(&sigState);
+                SchedulerLock();
                 threadList.erase(it);
-                MachineResumeSignals(&sigState);
+                SchedulerUnlock();
                 threadSchedule(WAIT_FOR_PRIO);
                 return VM_STATUS_SUCCESS;
             }
@@ -715,15 +1201,14 @@ TVMStatus VMThreadActivate(TVMThreadID threadID){
         }
     }
     if(t == NULL){
-        MachineResumeSignals(&sigState);
         return VM_STATUS_ERROR_INVALID_ID;
     }
 
-    MachineSuspendSignals(&sigState);
+    SchedulerLock();
     t->state = VM_THREAD_STATE_READY;
     MachineContextCreate(&(t->cntx), &ThreadWrapper, t, t->stackAdr, t->stackSize);
     readyThreadList.push(t);
-    MachineResumeSignals(&sigState);
+    SchedulerUnlock();
 
     if(threadID > 1)
         threadSchedule(WAIT_FOR_PRIO);
@@ -776,10 +1261,11 @@ TVMStatus VMThreadSleep(TVMTick tick){
         threadSchedule(WAIT_FOR_PRIO);
     }
     else{
-        MachineSuspendSignals(&sigState);
+        SchedulerLock();
+        UpdateTick();
         runningThread->timeup = g_tick + tick;
-        MachineResumeSignals(&sigState);
         threadSchedule(WAIT_FOR_SLEEP);
+        SchedulerUnlock();
     }
 
     return VM_STATUS_SUCCESS;
@@ -836,22 +1322,22 @@ TVMStatus VMMutexQuery(TVMMutexID mutexID, TVMThreadIDRef ownerref){
 TVMStatus VMMutexAcquire(TVMMutexID mutexID, TVMTick timeout){
     for(auto it = mutexList.begin(); it != mutexList.end(); ++it){
         if((*it)->mid == mutexID){
+            UpdateTick();
             unsigned int timeup = g_tick + timeout;
             while(1){
+                SchedulerLock();
                 //Mutex not already locked
                 if(!(*it)->locked){
-                    MachineSuspendSignals(&sigState);
                     (*it)->owner = runningThread->tid;
                     (*it)->locked = true;
-                    MachineResumeSignals(&sigState);
+                    SchedulerUnlock();
                     return VM_STATUS_SUCCESS;
                 }
                     //Mutex already locked
                 else{
-                    MachineSuspendSignals(&sigState);
                     (*it)->waitlist.push(runningThread);
-                    MachineResumeSignals(&sigState);
                     threadSchedule(WAIT_FOR_MUTEX);
+                    SchedulerUnlock();
                     if(timeup != VM_TIMEOUT_INFINITE && g_tick > timeup){
                         return VM_STATUS_FAILURE;
                     }
@@ -871,27 +1357,27 @@ TVMStatus VMMutexRelease(TVMMutexID mutexID){
                 return VM_STATUS_ERROR_INVALID_STATE;
             }
 
-            MachineSuspendSignals(&sigState);
+            SchedulerLock();
             (*it)->locked = false;
             (*it)->owner = 0;
-            MachineResumeSignals(&sigState);
+            SchedulerUnlock();
 
             if((*it)->waitlist.empty())
                 return VM_STATUS_SUCCESS;
 
             else if((*it)->waitlist.top()->prio > runningThread->prio){
-                MachineSuspendSignals(&sigState);
+                SchedulerLock();
                 readyThreadList.push((*it)->waitlist.top());
                 (*it)->waitlist.pop();
-                MachineResumeSignals(&sigState);
+                SchedulerUnlock();
                 threadSchedule(WAIT_FOR_PRIO);
                 return VM_STATUS_SUCCESS;
             }
             else {
-                MachineSuspendSignals(&sigState);
+                SchedulerLock();
                 readyThreadList.push((*it)->waitlist.top());
                 (*it)->waitlist.pop();
-                MachineResumeSignals(&sigState);
+                SchedulerUnlock();
                 return VM_STATUS_SUCCESS;
             }
         }
@@ -917,6 +1403,96 @@ TVMStatus VMDirectoryClose(int dirdescriptor){
     return VM_STATUS_SUCCESS;
 }
 
+// Reads into a buffer lent from shared memory instead of copying into the
+// caller's, *length is clamped to what could be lent. The buffer stays the
+// thread's until VMFileReleaseShared.
+TVMStatus VMFileReadShared(int filedescriptor, void **data, int *length){
+    if(data == NULL || length == NULL || *length < 0)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+
+    int offset = -1;
+    int fd = filedescriptor;
+    if(filedescriptor >= 3){
+        FATFile* file = FindOpenFile(filedescriptor);
+        if(file == NULL)
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        if(*length > (int)file->rootEntry.DSize)
+            *length = file->rootEntry.DSize;
+        offset = FATDataOffset(file);
+        fd = FATFd;
+    }
+    *data = NULL;
+    if(*length == 0)
+        return VM_STATUS_SUCCESS;
+
+    TVMStatus status = VMFileAllocateShared(data, length);
+    if(status != VM_STATUS_SUCCESS)
+        return status;
+    int result = FileTransferShared(false, fd, offset, *data, *length);
+    if(result < 0){
+        VMFileReleaseShared(*data);
+        *data = NULL;
+        return VM_STATUS_FAILURE;
+    }
+    *length = result;
+    return VM_STATUS_SUCCESS;
+}
+
+// Writes straight from a buffer lent by VMFileReadShared or
+// VMFileAllocateShared, the buffer is still the caller's afterwards
+TVMStatus VMFileWriteShared(int filedescriptor, void *data, int *length){
+    if(data == NULL || length == NULL || *length < 0)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    SchedulerLock();
+    int lentSize = SharedMemLentSize(data);
+    SchedulerUnlock();
+    if(*length > lentSize)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+
+    FATFile* file = NULL;
+    int offset = -1;
+    int fd = filedescriptor;
+    if(filedescriptor >= 3){
+        file = FindOpenFile(filedescriptor);
+        if(file == NULL)
+            return VM_STATUS_ERROR_INVALID_PARAMETER;
+        offset = FATDataOffset(file);
+        fd = FATFd;
+    }
+    int result = FileTransferShared(true, fd, offset, data, *length);
+    if(result < 0)
+        return VM_STATUS_FAILURE;
+    *length = result;
+    if(file != NULL && *length > (int)file->rootEntry.DSize)
+        file->rootEntry.DSize = *length;
+    return VM_STATUS_SUCCESS;
+}
+
+// Lends a contiguous shared buffer of up to *length bytes, waiting for
+// one to free up if all are in use
+TVMStatus VMFileAllocateShared(void **data, int *length){
+    if(data == NULL || length == NULL || *length <= 0)
+        return VM_STATUS_ERROR_INVALID_PARAMETER;
+    while(true){
+        SchedulerLock();
+        int lent = SharedMemLend(*length, data);
+        if(lent > 0){
+            SchedulerUnlock();
+            *length = lent;
+            return VM_STATUS_SUCCESS;
+        }
+        SharedMemWait(VM_TIMEOUT_INFINITE);
+        SchedulerUnlock();
+    }
+}
+
+TVMStatus VMFileReleaseShared(void *data){
+    SchedulerLock();
+    bool returned = SharedMemReturn(data);
+    SchedulerUnlock();
+    return returned ? VM_STATUS_SUCCESS : VM_STATUS_ERROR_INVALID_PARAMETER;
+}
+
 TVMStatus VMDirectoryChange(const char *path){
     return VM_STATUS_SUCCESS;
 }
@@ -925,19 +1501,16 @@ TVMStatus VMDirectoryRead(int dirdescriptor, SVMDirectoryEntryRef dirent){
     if(dirent == NULL)
         return VM_STATUS_ERROR_INVALID_PARAMETER;
 
-    int offset = 0;
-    FileSeek(FATFd, directoryByteIndex, SEEK_SET, &offset);
-
     uint8_t tmpEntry[32];
     int len = 32;
-    FileRead(FATFd, tmpEntry, &len);
+    FATRead(directoryByteIndex, tmpEntry, &len);
 
     //End of Directory
     if(tmpEntry[0] == 0x00)
         return VM_STATUS_FAILURE;
     while(tmpEntry[0] == 0xE5){
         directoryByteIndex += 32;
-        FileRead(FATFd, tmpEntry, &len);
+        FATRead(directoryByteIndex, tmpEntry, &len);
     }
 
     //Directory
@@ -947,7 +1520,7 @@ TVMStatus VMDirectoryRead(int dirdescriptor, SVMDirectoryEntryRef dirent){
             dirent->DLongFileName[i] = tmpEntry[i+1];
         }
         dirent->DLongFileName[255] = '\0';
-        FileRead(FATFd, tmpEntry, &len);
+        FATRead(directoryByteIndex + 32, tmpEntry, &len);
         directoryByteIndex += 32;
     }
 
@@ -71,6 +71,8 @@ typedef struct{
 typedef void (*TVMMainEntry)(int, char*[]);
 typedef void (*TVMThreadEntry)(void *);
 
+void VMSetMountMapped(int mapped);
+void VMSetTickless(int enable);
 TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, const char *mount, int argc, char *argv[]);
 
 TVMStatus VMTickMS(int *tickmsref);
@@ -96,9 +98,15 @@ TVMStatus VMMutexRelease(TVMMutexID mutex);
 TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescriptor);
 TVMStatus VMFileClose(int filedescriptor);      
 TVMStatus VMFileRead(int filedescriptor, void *data, int *length);
+TVMStatus VMFileReadTimeout(int filedescriptor, void *data, int *length, TVMTick timeout);
 TVMStatus VMFileWrite(int filedescriptor, void *data, int *length);
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset);
+TVMStatus VMFileSync(int filedescriptor);
 TVMStatus VMFilePrint(int filedescriptor, const char *format, ...);
+TVMStatus VMFileReadShared(int filedescriptor, void **data, int *length);
+TVMStatus VMFileWriteShared(int filedescriptor, void *data, int *length);
+TVMStatus VMFileAllocateShared(void **data, int *length);
+TVMStatus VMFileReleaseShared(void *data);
 
 TVMStatus VMDateTime(SVMDateTimeRef curdatetime);
 
@@ -1,4 +1,5 @@
 #include "VirtualMachine.h" 	 	    		
+#include "Machine.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -6,6 +7,7 @@ int main(int argc, char *argv[]){
     int TickTimeMS = 100;
     TVMMemorySize SharedSize = 0x4000;
     int Offset = 1;
+    int WorkerCount;
     char *FATMount = "fat.ima";
     
     while(Offset < argc){
@@ -47,6 +49,62 @@ int main(int argc, char *argv[]){
             }
             FATMount = argv[Offset];
         }
+        else if(0 == strcmp(argv[Offset], "-L")){
+            // Latency report at exit
+            MachineSetLatencyReport(1);
+        }
+        else if(0 == strcmp(argv[Offset], "-l")){
+            // Tickless alarm
+            VMSetTickless(1);
+        }
+        else if(0 == strcmp(argv[Offset], "-m")){
+            // Map the FAT image for metadata access
+            VMSetMountMapped(1);
+        }
+        else if(0 == strcmp(argv[Offset], "-e")){
+            // I/O engine
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(0 == strcmp(argv[Offset], "poll")){
+                MachineSetEngine(MACHINE_ENGINE_POLL);
+            }
+            else if(0 == strcmp(argv[Offset], "uring")){
+                MachineSetEngine(MACHINE_ENGINE_URING);
+            }
+            else if(0 == strcmp(argv[Offset], "workers")){
+                MachineSetEngine(MACHINE_ENGINE_WORKERS);
+            }
+            else{
+                fprintf(stderr,"Invalid parameter for -e of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+        }
+        else if(0 == strcmp(argv[Offset], "-p")){
+            // Prefault the shared memory
+            MachineSetPrefault(1);
+        }
+        else if(0 == strcmp(argv[Offset], "-H")){
+            // Huge pages for the shared memory
+            MachineSetHugePages(1);
+        }
+        else if(0 == strcmp(argv[Offset], "-w")){
+            // Worker threads for -e workers
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(1 != sscanf(argv[Offset],"%d",&WorkerCount)){
+                fprintf(stderr,"Invalid parameter for -w of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+            if(0 >= WorkerCount){
+                fprintf(stderr,"Invalid parameter for -w must be positive!\n");    
+                return 1;
+            }
+            MachineSetWorkerCount(WorkerCount);
+        }
         else{
             break;
         }